@@ -0,0 +1,43 @@
+#!/bin/bash
+
+# Times every program under bench/ with each engine, best of a few runs.
+# Build with -DCMAKE_BUILD_TYPE=Release, Debug builds print too much to compare.
+
+HERE=$(realpath "$0")
+HERE=$(dirname "$HERE")
+prog="${1:-$HERE/build/zitp}"
+runs="${RUNS:-3}"
+engines="${ENGINES:-tree quick closure}"
+out=$(mktemp)
+trap 'rm -f $out' EXIT
+
+printf "%-12s" "program"
+for e in $engines; do printf "%10s" "$e"; done
+echo
+
+status=0
+for p in "$HERE"/bench/*/; do
+    name=$(basename "$p")
+    printf "%-12s" "$name"
+    expected=""
+    for e in $engines; do
+        best=""
+        for _ in $(seq "$runs"); do
+            start=$(date +%s%N)
+            "$prog" --engine "$e" -i "$p/input.txt" -p "$p/program.txt" -o "$out" >/dev/null
+            ms=$(( ($(date +%s%N) - start) / 1000000 ))
+            [[ -z "$best" || $ms -lt $best ]] && best=$ms
+        done
+        # Every engine has to agree on the output
+        if [[ -z "$expected" ]]; then
+            expected=$(cat "$out")
+        elif [[ "$(cat "$out")" != "$expected" ]]; then
+            printf "%10s" "differs"
+            status=1
+            continue
+        fi
+        printf "%10s" "${best}ms"
+    done
+    echo
+done
+exit $status
@@ -0,0 +1,33 @@
+#!/bin/bash
+
+# Checks that the budget case runs with exactly the fuel and depth it needs
+# and no less, and that a loop, a recursion and a recursion building
+# closures that never end stop with the exit code of the limit they hit,
+# even under a depth limit the default stack would not hold.
+
+. "$(dirname "$(realpath "$0")")/test_lib.sh"
+p="$HERE/tests/budget"
+
+# Runs the case with input $1 and the remaining options, expecting code $2
+expect() {
+    local input=$1 code=$2
+    shift 2
+    echo "$input" > "$dir/in"
+    "$prog" "$@" -p "$p/program.txt" -i "$dir/in" -o "$dir/out" >/dev/null 2>&1
+    local got=$?
+    [[ $got -eq $code ]] || fail "input $input, $* exited $got, expected $code"
+}
+
+for engine in tree quick closure; do
+    # 10 loop iterations and 452 calls of fib, 10 deep at most
+    expect 0 0 --engine $engine --fuel 462 --max-depth 10
+    expect 0 3 --engine $engine --fuel 461
+    expect 0 4 --engine $engine --max-depth 9
+    expect 1 3 --engine $engine --fuel 100000
+    expect 2 4 --engine $engine --max-depth 1000
+    # More calls than the usual 8 MB stack holds, the run gets a larger one
+    expect 2 4 --engine $engine --max-depth 100000
+    expect 3 5 --engine $engine --max-memory 1000000
+done
+
+exit $status
@@ -0,0 +1,47 @@
+#!/bin/bash
+
+# Checks that a run of every test case, with each engine, leaves nothing
+# behind but the closure cycle of the census case, that its exit census is
+# the expected one, and that SIGUSR1 takes a census while the case waits
+# for its input on a FIFO.
+
+. "$(dirname "$(realpath "$0")")/test_lib.sh"
+
+# Byte counts depend on the platform
+mask() {
+    sed -E 's/(bytes|retained) [0-9]+/\1 N/g' "$1"
+}
+
+for p in "$HERE"/tests/*/; do
+    use_case "$p"
+    for engine in tree quick closure; do
+        if ! prints_expected "$p" --engine $engine --heap-census "$dir/census" 2>/dev/null; then
+            fail "$name ($engine)"
+        elif [[ -f "$p/census.expected" ]]; then
+            diff -u "$p/census.expected" <(mask "$dir/census") >&2 ||
+                fail "$name ($engine census)"
+        elif ! grep -q "leaked 0 " "$dir/census"; then
+            fail "$name ($engine leaked)"
+        fi
+    done
+done
+
+mkfifo "$dir/fifo"
+for engine in tree quick closure; do
+    "$prog" --engine $engine --heap-census "$dir/census" \
+        -p "$HERE/tests/census/program.txt" -i "$dir/fifo" -o "$dir/out" >/dev/null &
+    pid=$!
+    # Opening the FIFO for writing returns once the first Read opened it,
+    # which is after the handler was installed
+    exec 3>"$dir/fifo"
+    kill -USR1 $pid
+    cat "$HERE/tests/census/input.txt" >&3
+    exec 3>&-
+    if ! wait $pid || ! grep -q "^census 1 signal" "$dir/census" ||
+       ! grep -q "^S1 global vars 4 .* path S1$" "$dir/census" ||
+       ! grep -q "^census 2 exit" "$dir/census"; then
+        fail "signal ($engine)"
+    fi
+done
+
+exit $status
@@ -0,0 +1,78 @@
+#!/bin/bash
+
+# Runs programs that fail at run time and checks that they exit with 1 and
+# the error every engine reports, whatever the options after the binary,
+# e.g. --lazy or --engine closure, change about how they run.
+
+HERE=$(realpath "$0")
+HERE=$(dirname "$HERE")
+prog="${1:-$HERE/build/zitp}"
+shift $(( $# < 1 ? $# : 1 ))
+opts=("$@")
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+# Runs the program on stdin with input $2, expecting error $1
+expect() {
+    local error=$1 input=$2
+    cat > "$dir/program.txt"
+    echo "$input" > "$dir/in"
+    "$prog" "${opts[@]}" -p "$dir/program.txt" -i "$dir/in" -o "$dir/out" >/dev/null 2>"$dir/err"
+    local got=$?
+    if [[ $got -ne 1 ]] || [[ "$(tail -n 1 "$dir/err")" != "ERROR: $error" ]]; then
+        echo >&2 "Failed: $case ${opts[*]} exited $got with '$(tail -n 1 "$dir/err")', expected '$error'"
+        status=1
+    fi
+}
+
+status=0
+
+# The variable returned is only assigned for larger arguments
+case=return_unassigned
+expect "Return unexpected value" 5 <<'END'
+Begin
+    Function f Paras n
+    Begin
+        Var r End
+        If Gt n 100
+        Begin
+            Assign r 1
+        End
+        Else
+        Begin
+        End
+        Return r
+    End
+    Var g End
+    Var x End
+    Read x
+    Assign g f
+    Print Apply g Argus x End
+    Print 9
+End
+END
+
+# The same, called directly, so --parallel runs it on plain integers
+case=return_unassigned_direct
+expect "Return unexpected value" 5 <<'END'
+Begin
+    Function f Paras n
+    Begin
+        Var r End
+        If Gt n 100
+        Begin
+            Assign r 1
+        End
+        Else
+        Begin
+        End
+        Return r
+    End
+    Var x End
+    Read x
+    Print Apply f Argus x End
+    Print 9
+End
+END
+
+exit $status
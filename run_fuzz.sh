@@ -0,0 +1,191 @@
+#!/bin/bash
+
+# Differential testing: generates programs with zitp-gen, runs each with
+# every engine under every option that changes how it runs, multiplexed
+# and in SPMD lanes included, and compares the output and exit code with
+# those of the tree walker, run under the same --max-depth where the
+# configuration has one. Every fourth program declares no function, so
+# that --spmd runs it in lanes instead of falling back to the scalar
+# interpreter. A run that failed may have left its output unflushed, so
+# then the shorter output must start the longer one and the last error on
+# stderr must be the same. A run killed by a signal always counts as a
+# divergence. Each divergence is reduced to a small program written to
+# fuzz-<seed>.txt, with its input in fuzz-<seed>.in, and the time each
+# configuration took over all programs is printed at the end.
+#
+#   run_fuzz.sh [zitp] [zitp-gen] [programs] [zitp-gen options...]
+
+HERE=$(realpath "$0")
+HERE=$(dirname "$HERE")
+
+# Below the deepest recursions zitp-gen makes with --deep
+depth=100
+
+configs=(
+    "--engine quick"
+    "--engine closure"
+    "--engine tree --lazy"
+    "--engine quick --lazy"
+    "--engine closure --lazy"
+    "--engine quick --stream"
+    "--engine closure --stream"
+    "--engine closure --parse-threads 2"
+    "--engine quick --parallel 2"
+    "--engine closure --parallel 2"
+    "--engine quick --use-profile"
+    "--engine closure --use-profile"
+    "--engine quick --restore"
+    "--engine tree --multiplex"
+    "--engine closure --multiplex"
+    "--engine quick --spmd"
+    "--engine tree --max-depth $depth"
+    "--engine quick --max-depth $depth"
+    "--engine closure --max-depth $depth"
+    "--engine closure --lazy --max-depth $depth"
+    "--engine closure --stream --max-depth $depth"
+)
+
+# The tree walker run config $1 is compared with
+reference() {
+    if [[ "$1" == *--max-depth* ]]; then
+        echo "--engine tree --max-depth $depth"
+    else
+        echo "--engine tree"
+    fi
+}
+
+# Runs program $3 on input $4 with config $2 into $5, its stderr into
+# $5.err, prints the exit code
+run() {
+    local prog=$1 config=$2 program=$3 input=$4 out=$5
+    local opts=($config)
+    rm -f "$out" "$out.err" "$out.prof" "$out.snap"
+    case "$config" in
+        *--use-profile)
+            timeout 10 "$prog" "${opts[@]/--use-profile/--record-profile}" "$out.prof" \
+                -p "$program" -i "$input" -o /dev/null >/dev/null 2>&1
+            # A failed run records no profile, run without one then
+            [[ -f "$out.prof" ]] && opts+=("$out.prof") || opts=(${config%--use-profile})
+            ;;
+        *--restore)
+            timeout 10 "$prog" "${opts[@]/--restore/--snapshot-after-init}" "$out.snap" \
+                -p "$program" -i "$input" -o /dev/null >/dev/null 2>&1
+            # Nor is a snapshot taken without a top-level Read
+            [[ -f "$out.snap" ]] && opts+=("$out.snap") || opts=(${config%--restore})
+            ;;
+    esac
+    if [[ "$config" == *--multiplex* || "$config" == *--spmd* ]]; then
+        timeout 10 "$prog" "${opts[@]}" -p "$program" "$input:$out" >/dev/null 2>"$out.err"
+    else
+        timeout 10 "$prog" "${opts[@]}" -p "$program" -i "$input" -o "$out" >/dev/null 2>"$out.err"
+    fi
+    echo $?
+}
+
+# The error a run with output $1 failed with, warnings about printing an
+# unassigned variable are left out and the instance of --multiplex dropped
+error() {
+    grep '^ERROR: ' "$1.err" 2>/dev/null | grep -v '^ERROR: Invalid kind of var' |
+        tail -n 1 | sed 's/^ERROR: instance [0-9]*: /ERROR: /'
+}
+
+# Whether exit codes $1 and $2 and outputs $3 and $4 agree, and neither run
+# crashed. Runs printing nothing may leave no output file or an empty line.
+same() {
+    # Killed by a signal is a crash, whatever the tree walker did
+    [[ $1 -eq $2 && $1 -lt 128 ]] || return 1
+    local a b
+    a=$(cat "$3" 2>/dev/null)
+    b=$(cat "$4" 2>/dev/null)
+    [[ $1 -ne 0 ]] || [[ "$a" == "$b" ]] || return 1
+    # Failed runs may have left the end of their output unflushed
+    [[ "$a" == "$b"* || "$b" == "$a"* ]] && [[ "$(error "$3")" == "$(error "$4")" ]]
+}
+
+# Whether config $2 and its tree walker run disagree on program $4, input $3
+differs() {
+    local prog=$1 config=$2 input=$3 program=$4 dir
+    dir=$(mktemp -d)
+    local expected got
+    expected=$(run "$prog" "$(reference "$config")" "$program" "$input" "$dir/expected")
+    got=$(run "$prog" "$config" "$program" "$input" "$dir/got")
+    local status=1
+    # A program the tree walker does not finish proves nothing
+    if [[ $expected -ne 124 ]] && ! same $expected $got "$dir/expected" "$dir/got"; then
+        status=0
+    fi
+    rm -rf "$dir"
+    return $status
+}
+
+# Called back by zitp-gen --reduce with the program to try last
+if [[ "$1" == "--differs" ]]; then
+    differs "$2" "$3" "$4" "$5"
+    exit
+fi
+
+prog=$(realpath "${1:-$HERE/build/zitp}")
+gen="${2:-$HERE/build/zitp-gen}"
+count="${3:-100}"
+shift $(( $# < 3 ? $# : 3 ))
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+# Every fourth program declares no function, so --spmd runs it in lanes
+shape() {
+    (( $1 % 4 )) || echo "--functions 0 --closures 0"
+}
+
+# Shrinks the program of seed $1 for as long as config $2 disagrees on it,
+# once per seed
+reduce() {
+    [[ -f "fuzz-$1.txt" ]] && return
+    "$gen" --seed "$1" $(shape "$1") "${opts[@]}" -p "$PWD/fuzz-$1.txt" -i "$PWD/fuzz-$1.in" \
+        --reduce "'$(realpath "$0")' --differs '$prog' '$2' '$PWD/fuzz-$1.in'" &&
+        echo >&2 "        reduced to fuzz-$1.txt"
+}
+
+opts=("$@")
+declare -A total expected
+status=0
+for seed in $(seq "$count"); do
+    "$gen" --seed "$seed" $(shape "$seed") "${opts[@]}" -p "$dir/program.txt" -i "$dir/input.txt" || exit 1
+    for config in "--engine tree" "${configs[@]}"; do
+        start=$(date +%s%N)
+        code=$(run "$prog" "$config" "$dir/program.txt" "$dir/input.txt" "$dir/out")
+        total[$config]=$(( ${total[$config]:-0} + ($(date +%s%N) - start) / 1000 ))
+        ref=$(reference "$config")
+        file="$dir/expected"
+        [[ "$ref" == *--max-depth* ]] && file+="-depth"
+        if [[ "$config" == "$ref" ]]; then
+            expected[$config]=$code
+            rm -f "$file" "$file.err"
+            [[ -f "$dir/out" ]] && mv "$dir/out" "$file"
+            mv "$dir/out.err" "$file.err"
+            if [[ $code -eq 124 && "$config" == "--engine tree" ]]; then
+                echo >&2 "Skipped: seed $seed, the tree walker took over 10s"
+                break
+            fi
+            if [[ $code -ge 128 ]]; then
+                echo >&2 "Failed: seed $seed, $config crashed with $code"
+                status=1
+                reduce "$seed" "$config"
+                break
+            fi
+            continue
+        fi
+        # A reference that does not finish proves nothing
+        [[ ${expected[$ref]} -eq 124 ]] && continue
+        same ${expected[$ref]} $code "$file" "$dir/out" && continue
+        echo >&2 "Failed: seed $seed, $config exited $code, $ref ${expected[$ref]}"
+        status=1
+        # Keeps the first divergence of a program, reduced
+        reduce "$seed" "$config"
+    done
+done
+
+printf "%-44s%10s\n" "configuration" "time"
+for config in "--engine tree" "${configs[@]}"; do
+    printf "%-44s%8sms\n" "$config" $(( ${total[$config]} / 1000 ))
+done
+exit $status
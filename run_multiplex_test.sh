@@ -0,0 +1,53 @@
+#!/bin/bash
+
+# Runs several instances of every test case in one `zitp --multiplex`
+# process, some of them fed through pipes that only deliver input late,
+# and checks that an instance recursing without end does not take down
+# the others.
+
+HERE=$(realpath "$0")
+HERE=$(dirname "$HERE")
+prog="${1:-$HERE/build/zitp}"
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+status=0
+for p in "$HERE"/tests/*/; do
+    name=$(basename "$p")
+    in="$p/input.txt"
+    [[ -f "$in" ]] || in=/dev/null
+    "$prog" -p "$p/program.txt" --multiplex \
+        "$in:$dir/0" \
+        <(sleep 0.2; cat "$in"):"$dir/1" \
+        <(cat "$in"):"$dir/2" \
+        <(sleep 0.1; cat "$in"):"$dir/3" >/dev/null
+
+    if [[ $? -ne 0 ]]; then
+        echo >&2 "Failed: $name"
+        status=1
+        continue
+    fi
+    for i in 0 1 2 3; do
+        if ! diff -q "$p/output.expected" "$dir/$i" >/dev/null; then
+            echo >&2 "Failed: $name (instance $i)"
+            status=1
+        fi
+    done
+done
+
+# An instance recursing without end fails alone, within the default depth
+# or the one given, and the instance next to it still prints its output
+p="$HERE/tests/budget"
+echo 2 > "$dir/deep"
+for opts in "" "--max-depth 20000"; do
+    "$prog" -p "$p/program.txt" $opts --multiplex \
+        "$dir/deep:$dir/0" "$p/input.txt:$dir/1" >/dev/null 2>"$dir/err"
+    code=$?
+    if [[ $code -ne 1 ]] || ! grep -q "instance 0: Call depth limit exceeded" "$dir/err" ||
+        ! diff -q "$p/output.expected" "$dir/1" >/dev/null; then
+        echo >&2 "Failed: deep recursion next to another instance ${opts:+($opts) }exited $code"
+        status=1
+    fi
+done
+
+exit $status
@@ -0,0 +1,20 @@
+#!/bin/bash
+
+# Checks that parsing every test case on several threads gives the tree a
+# sequential parse gives, and that it still prints the expected output.
+
+. "$(dirname "$(realpath "$0")")/test_lib.sh"
+
+for p in "$HERE"/tests/*/; do
+    use_case "$p"
+    "$prog" --dump-ast "$dir/sequential" -p "$p/program.txt" -i "$in" -o "$dir/out" >/dev/null 2>&1
+    for threads in 2 4; do
+        if ! prints_expected "$p" --parse-threads $threads --dump-ast "$dir/parallel"; then
+            fail "$name ($threads threads)"
+        elif ! cmp -s "$dir/sequential" "$dir/parallel"; then
+            fail "$name ($threads threads, tree differs)"
+        fi
+    done
+done
+
+exit $status
@@ -0,0 +1,24 @@
+#!/bin/bash
+
+# Records a profile of every test case with each engine and checks that
+# running the case with that profile applied, with any engine, still prints
+# the expected output.
+
+. "$(dirname "$(realpath "$0")")/test_lib.sh"
+
+for p in "$HERE"/tests/*/; do
+    use_case "$p"
+    for recorder in tree quick closure; do
+        rm -f "$dir/profile"
+        if ! prints_expected "$p" --engine $recorder --record-profile "$dir/profile"; then
+            fail "$name ($recorder recording)"
+            continue
+        fi
+        for engine in tree quick closure; do
+            prints_expected "$p" --engine $engine --use-profile "$dir/profile" ||
+                fail "$name ($recorder profile, $engine run)"
+        done
+    done
+done
+
+exit $status
@@ -0,0 +1,88 @@
+#!/bin/bash
+
+# Runs every test case through one `zitp --serve` instance, then checks
+# that programs failing at run time leave it serving and that requests
+# over --max-request are refused.
+
+HERE=$(realpath "$0")
+HERE=$(dirname "$HERE")
+prog="${1:-$HERE/build/zitp}"
+dir=$(mktemp -d)
+sock="$dir/zitp.sock"
+
+"$prog" --serve "$sock" --workers 2 >/dev/null &
+server=$!
+trap 'kill $server 2>/dev/null; wait $server; rm -rf $dir' EXIT
+
+for _ in $(seq 50); do
+    [[ -S "$sock" ]] && break
+    sleep 0.1
+done
+
+status=0
+for p in "$HERE"/tests/*/; do
+    name=$(basename "$p")
+    # Twice: the first run loads the program, the second hits the cache
+    for _ in 1 2; do
+        rm -f "$dir/out"
+        if ! "$prog" --connect "$sock" -i "$p/input.txt" -p "$p/program.txt" -o "$dir/out" \
+            || ! diff -q "$p/output.expected" "$dir/out" >/dev/null
+        then
+            echo >&2 "Failed: $name"
+            status=1
+        fi
+    done
+done
+
+# Returning an unassigned variable and recursing without end fail their
+# request, not the server
+cat > "$dir/unassigned.txt" <<'END'
+Begin
+    Function f Paras n
+    Begin
+        Var r End
+        Return r
+    End
+    Var g End
+    Assign g f
+    Print Apply g Argus 1 End
+End
+END
+cat > "$dir/deep.txt" <<'END'
+Begin
+    Function f Paras n
+    Begin
+        Return Plus 1 Apply f Argus n End
+    End
+    Print Apply f Argus 1 End
+End
+END
+for name in unassigned deep; do
+    if "$prog" --connect "$sock" -i /dev/null -p "$dir/$name.txt" -o "$dir/out" 2>/dev/null; then
+        echo >&2 "Failed: $name did not fail"
+        status=1
+    fi
+done
+p="$HERE/tests/io"
+if ! "$prog" --connect "$sock" -i "$p/input.txt" -p "$p/program.txt" -o "$dir/out" \
+    || ! diff -q "$p/output.expected" "$dir/out" >/dev/null
+then
+    echo >&2 "Failed: the server did not survive"
+    status=1
+fi
+
+# A server taking requests of 16 bytes at most refuses to load the program
+"$prog" --serve "$dir/small.sock" --workers 1 --max-request 16 >/dev/null &
+small=$!
+for _ in $(seq 50); do
+    [[ -S "$dir/small.sock" ]] && break
+    sleep 0.1
+done
+if "$prog" --connect "$dir/small.sock" -i "$p/input.txt" -p "$p/program.txt" -o "$dir/out" 2>/dev/null; then
+    echo >&2 "Failed: a request over --max-request was served"
+    status=1
+fi
+kill $small
+wait $small
+
+exit $status
@@ -0,0 +1,23 @@
+#!/bin/bash
+
+# Takes a snapshot of every test case at its first Read and checks that
+# restoring it, with any engine, prints the expected output. Cases whose
+# first Read is not a top-level command take no snapshot and are skipped.
+
+. "$(dirname "$(realpath "$0")")/test_lib.sh"
+
+for p in "$HERE"/tests/*/; do
+    use_case "$p"
+    for taker in tree closure; do
+        rm -f "$dir/snap"
+        "$prog" --engine $taker --snapshot-after-init "$dir/snap" \
+            -p "$p/program.txt" -i "$in" -o "$dir/out" >/dev/null 2>&1
+        [[ -f "$dir/snap" ]] || continue
+        for engine in tree quick closure; do
+            prints_expected "$p" --engine $engine --restore "$dir/snap" ||
+                fail "$name ($taker snapshot, $engine restore)"
+        done
+    done
+done
+
+exit $status
@@ -0,0 +1,43 @@
+#!/bin/bash
+
+# Runs the spmd case over 150 inputs in one `zitp --spmd` process and
+# compares every output with a multiplexed run of the tree walker, which
+# also keeps what an instance printed before it failed. The inputs diverge
+# in their loops, divide by zero, return early and run out of input, and
+# the longest loops run alone long enough to be dropped from their lanes.
+# Cases that do not vectorize must still give their expected output.
+
+. "$(dirname "$(realpath "$0")")/test_lib.sh"
+p="$HERE/tests/spmd"
+
+pairs=()
+for i in $(seq 0 149); do
+    case $((i % 5)) in
+        0) echo "$((i * 7 + 1)) $((i % 12))" ;;
+        1) echo "$((i * 13 % 97)) 0" ;;
+        2) echo "$i" ;;
+        3) echo "" ;;
+        *) echo "$((i * 31 % 500)) $((i % 7 - 2))" ;;
+    esac > "$dir/in$i"
+    pairs+=("$dir/in$i:$dir/out$i")
+done
+# Takes 350 steps where every other input takes far fewer
+echo "77031 3" > "$dir/in77"
+
+"$prog" --stats --spmd -p "$p/program.txt" "${pairs[@]}" >/dev/null 2>"$dir/err"
+grep -Eq "spmd: vectorized, in lanes [0-9]+, dropped [1-9]" "$dir/err" ||
+    fail "$(grep spmd: "$dir/err")"
+for i in $(seq 0 149); do
+    "$prog" --engine tree --multiplex -p "$p/program.txt" "$dir/in$i:$dir/expected$i" >/dev/null 2>&1
+    cmp -s "$dir/expected$i" "$dir/out$i" || fail "input $(cat "$dir/in$i")"
+done
+
+for p in "$HERE"/tests/*/; do
+    use_case "$p"
+    "$prog" --spmd -p "$p/program.txt" "$in:$dir/0" "$in:$dir/1" >/dev/null 2>&1
+    for i in 0 1; do
+        cmp -s "$p/output.expected" "$dir/$i" || fail "$name (instance $i)"
+    done
+done
+
+exit $status
@@ -3,12 +3,14 @@
 HERE=$(realpath "$0")
 HERE=$(dirname "$HERE")
 name="$1"
-prog="$HERE/build/zitp"
+prog="${2:-$HERE/build/zitp}"
+# Anything after the binary is passed to it, e.g. --engine closure
+shift $(( $# < 2 ? $# : 2 ))
 p="$HERE/tests/$name"
 temp=$(mktemp)
 trap 'rm -f $temp' EXIT
 
-"$prog" -i "$p/input.txt" -p "$p/program.txt" -o "$temp" >/dev/null
+"$prog" "$@" -i "$p/input.txt" -p "$p/program.txt" -o "$temp" >/dev/null
 
 if [[ $? -ne 0 ]]; then
     echo >&2 "Failed: $name"
@@ -1,8 +1,14 @@
 #ifndef TERM_CPP
 #define TERM_CPP
 #include "Term.hpp"
+#include "symbol.hpp"
 #include <iostream>
 #include <string>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <streambuf>
+#include <thread>
 bool isnumber(const std::string &str){
     size_t i;
     for(i = 0; i < str.size(); i++)
@@ -47,6 +53,185 @@ bool isBoolExprtoken(const std::string &str){
     );
 }
 
+// Program text being parsed lazily, set by parse_lazy() and parse_body()
+static thread_local const std::shared_ptr<const std::string> *lazy_text = nullptr;
+// Set while parse_parallel() reads the top level, bodies are only matched
+static thread_local bool prescan = false;
+
+// Reads part of the program text in place, positions count from its start
+struct TextBuf : std::streambuf {
+    TextBuf(const std::string& text, size_t begin, size_t end) {
+        char *p = const_cast<char*>(text.data());
+        setg(p, p + begin, p + end);
+    }
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override {
+        if (off != 0 || dir != std::ios_base::cur) return pos_type(off_type(-1));
+        return pos_type(gptr() - eback());
+    }
+    pos_type seekpos(pos_type pos, std::ios_base::openmode) override {
+        setg(eback(), eback() + off_type(pos), egptr());
+        return pos;
+    }
+};
+
+static size_t offset(std::istream& input) {
+    return size_t(input.rdbuf()->pubseekoff(0, std::ios_base::cur, std::ios_base::in));
+}
+
+static void sort_unique(std::vector<uint32_t>& v) {
+    std::sort(v.begin(), v.end());
+    v.erase(std::unique(v.begin(), v.end()), v.end());
+}
+
+static bool is(const char *token, size_t n, const char *word) {
+    return n == strlen(word) && !memcmp(token, word, n);
+}
+
+// Finds the End of a Function body straight in the text, without
+// tokenizing it into strings, and hands every token up to it to seen
+template <class F>
+static bool match_body(std::istream& input, LazyBody& lazy, F seen) {
+    const char *text = lazy.text->data(), *end = text + lazy.text->size();
+    const char *p = text + lazy.begin;
+    int depth = 1;
+    while (depth > 0) {
+        while (p < end && isspace((unsigned char)*p)) ++p;
+        if (p == end) return false;
+        const char *token = p;
+        while (p < end && !isspace((unsigned char)*p)) ++p;
+        size_t n = p - token;
+        if (is(token, n, "Begin") || is(token, n, "Var") || is(token, n, "Argus")) depth++;
+        else if (is(token, n, "End")) depth--;
+        seen(token, n);
+    }
+    lazy.end = p - text;
+    input.rdbuf()->pubseekpos(lazy.end);
+    return true;
+}
+
+// Skips a Function body by matching its End, noting the names it mentions.
+// A name nothing interned yet cannot be declared outside the body, since
+// those declarations were parsed already, so only names found in the symbol
+// table are noted and the others are interned once the body is parsed.
+static Term* skip_body(std::istream& input, Term* father) {
+    auto lazy = std::make_shared<LazyBody>();
+    lazy->text = *lazy_text;
+    lazy->begin = offset(input);
+    bool found;
+    if (prescan) {
+        found = match_body(input, *lazy, [](const char *, size_t) {});
+    } else {
+        bool declaring = false;     // Inside Var ... End or Paras ... Begin
+        const char *prev = "";
+        size_t prev_n = 0;
+        found = match_body(input, *lazy, [&](const char *token, size_t n) {
+            if (is(token, n, "Var") || is(token, n, "Paras")) {
+                declaring = true;
+            } else if (is(token, n, "Begin") || is(token, n, "End")) {
+                declaring = false;
+            } else if (!declaring && !is(prev, prev_n, "Function") &&
+                       std::all_of(token, token + n, [](char c) { return c >= 'a' && c <= 'z'; })) {
+                if (uint32_t sym = find_symbol(std::string(token, n))) {
+                    lazy->uses.push_back(sym);
+                    if (is(prev, prev_n, "Assign") || is(prev, prev_n, "Read")) {
+                        lazy->assigns.push_back(sym);
+                    } else if (!is(prev, prev_n, "Apply") && !is(prev, prev_n, "Call")) {
+                        lazy->values.push_back(sym);
+                    }
+                }
+            }
+            prev = token;
+            prev_n = n;
+        });
+        sort_unique(lazy->uses);
+        sort_unique(lazy->values);
+        sort_unique(lazy->assigns);
+    }
+    if (!found) {
+        std::cout<<"Error: End of Function body not found\n";
+        return nullptr;
+    }
+
+    Term *block = new Term(Block);
+    block->lazy = lazy;
+    block->father = father;
+    father->sons.push_back(block);
+    return block;
+}
+
+Term* parse_lazy(const std::shared_ptr<const std::string>& text)
+{
+    TextBuf buf(*text, 0, text->size());
+    std::istream input(&buf);
+    auto saved = lazy_text;
+    lazy_text = &text;
+    Term *ast = parse(input);
+    lazy_text = saved;
+    return ast;
+}
+
+// Parses the text of a skipped body into block, skipping the bodies of
+// its Functions again when text is given
+static bool fill_body(Term* block, const std::shared_ptr<const std::string>* text)
+{
+    const LazyBody& lazy = *block->lazy;
+    TextBuf buf(*lazy.text, lazy.begin, lazy.end);
+    std::istream input(&buf);
+    auto saved = lazy_text;
+    lazy_text = text;
+    Term *body = parse(input, "Begin");
+    lazy_text = saved;
+    if (body == nullptr) return false;
+    block->sons.swap(body->sons);
+    for (auto son : block->sons) son->father = block;
+    delete body;
+    return true;
+}
+
+bool parse_body(Term* block)
+{
+    return fill_body(block, &block->lazy->text);
+}
+
+static void skipped_bodies(Term* t, std::vector<Term*>& out)
+{
+    if (t->kind == Block && t->lazy) out.push_back(t);
+    for (auto son : t->sons) skipped_bodies(son, out);
+}
+
+Term* parse_parallel(const std::shared_ptr<const std::string>& text, unsigned threads)
+{
+    TextBuf buf(*text, 0, text->size());
+    std::istream input(&buf);
+    auto saved = lazy_text;
+    lazy_text = &text;
+    prescan = true;
+    Term *ast = parse(input);
+    prescan = false;
+    lazy_text = saved;
+    if (ast == nullptr) return nullptr;
+
+    std::vector<Term*> bodies;
+    skipped_bodies(ast, bodies);
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    auto work = [&] {
+        for (size_t i; (i = next++) < bodies.size();) {
+            if (!fill_body(bodies[i], nullptr)) failed = true;
+            bodies[i]->lazy.reset();
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads && i < bodies.size(); ++i) pool.emplace_back(work);
+    work();
+    for (auto& t : pool) t.join();
+    if (failed) {
+        delete ast;
+        return nullptr;
+    }
+    return ast;
+}
+
 Term* parse(std::istream& input,std::string pretext,Term* father,bool ExprNeeded)
 {
     if(input.eof()) return father;
@@ -72,7 +257,7 @@ Term* parse(std::istream& input,std::string pretext,Term* father,bool ExprNeeded
         else{
             cur_term->kind = Name;
         }
-        cur_term->name = pretext;
+        cur_term->sym = intern(pretext);
         #if DEBUG_MODE
         std::cout<<cur_term->kind<<' ';
         #endif
@@ -144,7 +329,7 @@ Term* parse(std::istream& input,std::string pretext,Term* father,bool ExprNeeded
             input>>next_text;
         }
 
-        Term *new_pro = parse(input,next_text,cur_term);
+        Term *new_pro = lazy_text ? skip_body(input,cur_term) : parse(input,next_text,cur_term);
         if(new_pro==nullptr||new_pro->kind != Block){
             std::cout<<"Error: Program section needed for Function\n";
             return nullptr;
@@ -400,66 +585,69 @@ Term* parse(std::istream& input,std::string pretext,Term* father,bool ExprNeeded
 
     return cur_term;
 }
+const std::string& Term::name() const{
+    return symbol_name(sym);
+}
 static int tabs=0;
-void printtabs(){
+void printtabs(std::ostream& os){
     for(int i=0;i<tabs;i++){
-        std::cout<<"  ";
+        os<<"  ";
     }
 }
 void addtab(){tabs++;}
 void removetab(){tabs--;}
-void Term::print(){
+void Term::print(std::ostream& os){
     if(kind==Block) {
-        std::cout<<"Begin\n"<<std::flush;
+        os<<"Begin\n"<<std::flush;
         addtab();
         for(std::list<Term*>::iterator i=sons.begin();i!=sons.end();i++){
-            printtabs();
-            (*i)->print();
+            printtabs(os);
+            (*i)->print(os);
         }
         removetab();
-        printtabs();
-        std::cout<<"End\n"<<std::flush;
+        printtabs(os);
+        os<<"End\n"<<std::flush;
     }
     else if(kind==Function){
-        std::cout<<"Function "<<std::flush;
+        os<<"Function "<<std::flush;
         std::list<Term*>::iterator i = sons.begin();
-        (*i)->print();
-        std::cout<<"Paras "<<std::flush;
+        (*i)->print(os);
+        os<<"Paras "<<std::flush;
         for(i++;i!=sons.end();i++){
-            (*i)->print();
+            (*i)->print(os);
         }
     }
     else if(kind==Command){
         std::string showwords[]={"Var","Assign","Read","Print","Return"};
         if(subtype==Declaration||subtype==Assign||
             subtype==Read||subtype==Print||subtype==Return){
-            std::cout<<showwords[subtype]<<' '<<std::flush;
-            for(std::list<Term*>::iterator i=sons.begin();i!=sons.end();i++)(*i)->print();
-            if(subtype==Declaration)std::cout<<"End";
-            std::cout<<"\n"<<std::flush;
+            os<<showwords[subtype]<<' '<<std::flush;
+            for(std::list<Term*>::iterator i=sons.begin();i!=sons.end();i++)(*i)->print(os);
+            if(subtype==Declaration)os<<"End";
+            os<<"\n"<<std::flush;
         }
         else if(subtype==If){
-            std::cout<<"If "<<std::flush;
+            os<<"If "<<std::flush;
             std::list<Term*>::iterator i=sons.begin();
-            (*(i++))->print();
-            (*(i++))->print();
-            printtabs();
-            std::cout<<"Else "<<std::flush;
-            (*i)->print();
+            (*(i++))->print(os);
+            (*(i++))->print(os);
+            printtabs(os);
+            os<<"Else "<<std::flush;
+            (*i)->print(os);
         }
         else if(subtype==While){
-            std::cout<<"While "<<std::flush;
+            os<<"While "<<std::flush;
             std::list<Term*>::iterator i=sons.begin();
-            (*(i++))->print();
-            (*i)->print();
+            (*(i++))->print(os);
+            (*i)->print(os);
         }
         else if(subtype ==Call){
-            std::cout<<"Call "<<std::flush;
+            os<<"Call "<<std::flush;
             std::list<Term*>::iterator i=sons.begin();
-            (*(i++))->print();
-            std::cout<<" Argus "<<std::flush;
-            for(;i!=sons.end();++i)(*i)->print();
-            std::cout<<"End "<<std::flush;
+            (*(i++))->print(os);
+            os<<" Argus "<<std::flush;
+            for(;i!=sons.end();++i)(*i)->print(os);
+            os<<"End "<<std::flush;
         }
     }
     else if(kind==Expr){
@@ -467,18 +655,18 @@ void Term::print(){
         if(subtype==Plus||subtype==Minus||
             subtype==Mult||subtype==Div||
             subtype==Mod){
-            std::cout<<showwords[subtype-Plus]<<' '<<std::flush;
-            for(std::list<Term*>::iterator i=sons.begin();i!=sons.end();i++)(*i)->print();
+            os<<showwords[subtype-Plus]<<' '<<std::flush;
+            for(std::list<Term*>::iterator i=sons.begin();i!=sons.end();i++)(*i)->print(os);
         }
-        else if(subtype==Number) std::cout<<number<<' '<<std::flush;
-        else if(subtype==VarName)std::cout<<name<<' '<<std::flush;
+        else if(subtype==Number) os<<number<<' '<<std::flush;
+        else if(subtype==VarName)os<<name()<<' '<<std::flush;
         else if(subtype ==Apply){
-            std::cout<<"Apply "<<std::flush;
+            os<<"Apply "<<std::flush;
             std::list<Term*>::iterator i=sons.begin();
-            (*(i++))->print();
-            std::cout<<" Argus "<<std::flush;
-            for(;i!=sons.end();++i)(*i)->print();
-            std::cout<<"End "<<std::flush;
+            (*(i++))->print(os);
+            os<<" Argus "<<std::flush;
+            for(;i!=sons.end();++i)(*i)->print(os);
+            os<<"End "<<std::flush;
         }
     }
     else if(kind==BoolExpr){
@@ -486,12 +674,12 @@ void Term::print(){
         if(subtype==Lt||subtype==Gt||
             subtype==Eq||subtype==And||
             subtype==Or||subtype==Negb){
-            std::cout<<showwords[subtype-Lt]<<' '<<std::flush;
-            for(std::list<Term*>::iterator i=sons.begin();i!=sons.end();i++)(*i)->print();
+            os<<showwords[subtype-Lt]<<' '<<std::flush;
+            for(std::list<Term*>::iterator i=sons.begin();i!=sons.end();i++)(*i)->print(os);
         }
     }
     else if(kind==Name){
-        std::cout<<name<<' '<<std::flush;
+        os<<name()<<' '<<std::flush;
     }
 }
 #endif
@@ -1,39 +1,108 @@
-/*Term.h
-	为Minilan语言编写的Term类，用于处理程序文件，将其转化为语法树。
-	*/
-
-#ifndef TERM_H
-#define TERM_H
-#include<string>
-#include<list>
-#include<iostream>
-enum TermKind {
-    Block=0,
-    Function,
-    Command,
-    Expr,
-    BoolExpr,
-    Name,
-};
-enum TermSubtype {
-    Declaration=0,Assign=1,Read=2,Print=3,Return=4,If,While,Call,
-
-    Number,VarName,Plus,Minus,Mult,Div,Mod,Apply,
-
-    Lt,Gt,Eq,And,Or,Negb,
-};
-class Term{
-    public:
-        TermKind kind;
-        TermSubtype subtype;
-        Term* father;
-        std::list<Term*> sons;
-        int number;
-        std::string name;
-
-        Term(){}
-        Term(TermKind k){this->kind=k;}
-        void print();
-};
-extern Term* parse(std::istream& input,std::string pretext="",Term* father=nullptr,bool NameorExpr=false);
-#endif
+/*Term.h
+	为Minilan语言编写的Term类，用于处理程序文件，将其转化为语法树。
+	*/
+
+#ifndef TERM_H
+#define TERM_H
+#include<string>
+#include<list>
+#include<vector>
+#include<iostream>
+#include<cstdint>
+#include<memory>
+enum TermKind {
+    Block=0,
+    Function,
+    Command,
+    Expr,
+    BoolExpr,
+    Name,
+};
+enum TermSubtype {
+    Declaration=0,Assign=1,Read=2,Print=3,Return=4,If,While,Call,
+
+    Number,VarName,Plus,Minus,Mult,Div,Mod,Apply,
+
+    Lt,Gt,Eq,And,Or,Negb,
+};
+// Static types, ordered so that joining two types takes the larger one,
+// except Int and Func which join to Dyn
+enum StaticType {
+    NoType=0,   // Never assigned, only ever Null
+    IntType,
+    BoolType,
+    FuncType,
+    DynType,
+};
+class Term;
+class Zitp;
+class Scope;
+// Specialized evaluator an integer expression rewrites itself to, see quicken.hpp
+typedef int32_t (*IntHandler)(Zitp&, Term*, Scope*);
+
+// A Function body parse_lazy() only skipped, parsed on the first call
+struct LazyBody {
+    std::shared_ptr<const std::string> text;
+    size_t begin, end;                  // Its tokens after Begin, up to its End
+    std::vector<uint32_t> uses;         // Names it mentions, sorted
+    std::vector<uint32_t> values;       // ... used as values, not only called
+    std::vector<uint32_t> assigns;      // ... assigned or read into
+
+    // Filled in by convert_closures()
+    std::shared_ptr<void> scope;        // Static scope the body will be resolved in
+    std::vector<Term*> reads, writes;   // Declarations outside it may use or assign
+};
+
+class Term{
+    public:
+        TermKind kind;
+        TermSubtype subtype;
+        Term* father;
+        std::list<Term*> sons;
+        int number;
+        uint32_t sym;                // Interned identifier, see symbol.hpp
+
+        // Filled in by convert_closures()
+        Term* decl;                  // Name term declaring the variable this name refers to
+        bool boxed;                  // Declarations: captured and assigned, kept in a BoxValue
+        bool selfref;                // Functions: the body refers to the function itself
+        bool escapes;                // Functions: may outlive the block defining them
+        std::vector<Term*> captures; // Functions: declarations of the non-global free variables
+        bool flat;                   // Blocks: run in the scope of the enclosing block
+
+        // Filled in by infer_types()
+        StaticType type;             // Expressions and declarations
+
+        // Quickening state, see quicken.hpp
+        IntHandler eval;             // Replaces the generic path once set
+        uint8_t hits;                // Generic executions so far
+        uint8_t deopts;              // Speculations that failed
+        uint16_t depth;              // Names: scopes between the use and its variable
+        uint32_t slot;               // Names: position of the variable in that scope
+        Term* target;                // Apply: the function called when quickened
+
+        std::shared_ptr<LazyBody> lazy; // Blocks: a Function body not parsed yet
+
+        // Filled in from a profile, see profile.hpp
+        bool observed;               // Functions: calls go through Zitp::observe_call()
+        uint16_t frame;              // Functions: variables to reserve in a call scope
+
+        Term():father(nullptr),sym(0),decl(nullptr),boxed(false),selfref(false),escapes(false),flat(false),type(NoType),
+              eval(nullptr),hits(0),deopts(0),depth(0),slot(0),target(nullptr),
+              observed(false),frame(0){}
+        Term(TermKind k):Term(){this->kind=k;}
+        ~Term(){for(auto son:sons) delete son;}
+        const std::string& name() const;
+        void print(std::ostream& os = std::cout);
+};
+extern Term* parse(std::istream& input,std::string pretext="",Term* father=nullptr,bool NameorExpr=false);
+// Parses a program but leaves the body of every Function empty, see LazyBody
+extern Term* parse_lazy(const std::shared_ptr<const std::string>& text);
+// Fills in a lazy body, its own Functions are skipped again
+extern bool parse_body(Term* block);
+// Parses like parse() on up to threads threads: the top level is read
+// first, only matching the Begin and End of the Function bodies it meets,
+// then those bodies are parsed concurrently and filled in where they were
+// skipped. Symbol ids are handed out in another order, the tree is the same.
+extern Term* parse_parallel(const std::shared_ptr<const std::string>& text, unsigned threads);
+#endif
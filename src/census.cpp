@@ -0,0 +1,171 @@
+#include <unordered_map>
+#include <unordered_set>
+
+#include "census.hpp"
+#include "symbol.hpp"
+#include "zitp.hpp"
+
+volatile std::sig_atomic_t census_requested = 0;
+
+void request_census(int) {
+    census_requested = 1;
+}
+
+namespace {
+
+void functions_of(Term *t, std::vector<Term*>& out) {
+    if (t->kind == Function) out.push_back(t);
+    for (auto son : t->sons) functions_of(son, out);
+}
+
+template <class T>
+std::vector<const T*> live_objects() {
+    std::vector<const T*> all;
+    for (const T *o = Tracked<T>::live; o; o = o->next_live()) all.push_back(o);
+    // The list starts from the newest
+    return std::vector<const T*>(all.rbegin(), all.rend());
+}
+
+class Census {
+    struct Object {
+        const Scope *scope;
+        const FuncValue *func;
+        std::string path;
+        bool leaked;
+    };
+    std::unordered_map<Term*, u32> functions;
+    std::unordered_map<const void*, std::string> ids;
+    usize scopes = 0, funcs = 0;
+
+    public:
+    std::vector<Object> objects;
+
+    explicit Census(Term *ast) {
+        std::vector<Term*> funcs;
+        if (ast) functions_of(ast, funcs);
+        for (u32 i = 0; i < funcs.size(); ++i) functions[funcs[i]] = i;
+    }
+
+    const std::string& id(const void *o) const { return ids.at(o); }
+
+    std::string name(const FuncValue *fv) const {
+        Term *func = fv->value();
+        auto it = functions.find(func);
+        return func->sons.front()->name() +
+               (it == functions.end() ? "" : "@" + std::to_string(it->second));
+    }
+
+    void reach(const Scope *s, const std::string& from, bool leaked) {
+        if (ids.count(s)) return;
+        auto& id = ids[s] = "S" + std::to_string(++scopes);
+        objects.push_back({s, nullptr, from + id, leaked});
+    }
+    void reach(const FuncValue *fv, const std::string& from, bool leaked) {
+        if (ids.count(fv)) return;
+        auto& id = ids[fv] = "F" + std::to_string(++funcs);
+        objects.push_back({nullptr, fv, from + id + " " + name(fv), leaked});
+    }
+
+    // Everything reachable from the objects after the first from of them
+    void walk(usize from) {
+        for (usize i = from; i < objects.size(); ++i) {
+            Object o = objects[i];
+            if (o.func) {
+                if (o.func->outer) reach(o.func->outer.get(), o.path + " > ", o.leaked);
+                continue;
+            }
+            for (auto& var : o.scope->map) {
+                const Value *v = var.second.get();
+                if (v && v->kind == Box) v = static_cast<const BoxValue*>(v)->val.get();
+                if (!v || v->kind != Func) continue;
+                reach(static_cast<const FuncValue*>(v),
+                      o.path + "." + symbol_name(var.first) + " > ", o.leaked);
+            }
+        }
+    }
+};
+
+usize retained(const Scope *s, std::unordered_set<const void*>& seen);
+
+// Bytes of v and of what only it holds
+usize retained(const Value *v, std::unordered_set<const void*>& seen) {
+    if (!seen.insert(v).second) return 0;
+    switch (v->kind) {
+        case Integer:
+            return sizeof(IntValue);
+        case Boolean:
+            return sizeof(BoolValue);
+        case Box: {
+            auto& val = static_cast<const BoxValue*>(v)->val;
+            return sizeof(BoxValue) + (val && val->refs == 1 ? retained(val.get(), seen) : 0);
+        }
+        case Func: {
+            auto& outer = static_cast<const FuncValue*>(v)->outer;
+            return sizeof(FuncValue) + (outer && outer->refs == 1 ? retained(outer.get(), seen) : 0);
+        }
+        default:
+            return sizeof(NullValue);
+    }
+}
+
+usize retained(const Scope *s, std::unordered_set<const void*>& seen) {
+    if (!seen.insert(s).second) return 0;
+    usize n = s->bytes();
+    for (auto& var : s->map) {
+        if (var.second && var.second->refs == 1) n += retained(var.second.get(), seen);
+    }
+    return n;
+}
+
+}
+
+void Zitp::heap_census(const char *reason) {
+    census_requested = 0;
+    if (!census_out.is_open()) return;
+    Census c(ast);
+    auto scopes = live_objects<Scope>();
+    auto funcs = live_objects<FuncValue>();
+
+    for (auto s : scopes) {
+        if (!s->heap) c.reach(s, "", false);
+    }
+    c.walk(0);
+    // Functions the frame stack holds after their name was reassigned
+    usize at = c.objects.size();
+    for (auto& fv : frames) c.reach(&fv, "frames > ", false);
+    c.walk(at);
+    usize leaked = c.objects.size();
+    // Each from the oldest one left, so a cycle is listed from where it starts
+    for (auto s : scopes) {
+        at = c.objects.size();
+        c.reach(s, "", true);
+        c.walk(at);
+    }
+    for (auto fv : funcs) {
+        at = c.objects.size();
+        c.reach(fv, "", true);
+        c.walk(at);
+    }
+
+    usize bytes = 0;
+    for (auto s : scopes) bytes += s->bytes();
+    bytes += funcs.size() * sizeof(FuncValue);
+    census_out << "census " << ++censuses << " " << reason << "\n"
+               << "scopes " << scopes.size() << " functions " << funcs.size()
+               << " leaked " << c.objects.size() - leaked << " bytes " << bytes << "\n";
+    for (auto& o : c.objects) {
+        std::unordered_set<const void*> seen;
+        if (o.scope) {
+            census_out << c.id(o.scope) << " "
+                       << (o.scope->heap ? "env" : o.scope->outer ? "stack" : "global")
+                       << " vars " << o.scope->map.size() << " refs " << o.scope->refs
+                       << " retained " << retained(o.scope, seen);
+        } else {
+            census_out << c.id(o.func) << " " << c.name(o.func)
+                       << (o.func->value()->escapes ? " closure" : " frame")
+                       << " refs " << o.func->refs << " retained " << retained(o.func, seen);
+        }
+        census_out << (o.leaked ? " leaked" : "") << " path " << o.path << "\n";
+    }
+    census_out.flush();
+}
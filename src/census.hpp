@@ -0,0 +1,28 @@
+#ifndef ZITP_CENSUS_H
+#define ZITP_CENSUS_H
+
+#include <csignal>
+
+/*
+ * Heap census, see --heap-census.
+ *
+ * Every Scope and FuncValue alive on the thread is on a Tracked list. A
+ * census walks them from the roots, the scopes on the stack and the frame
+ * stack, through the values of each scope, boxes and the outer scope of
+ * each function, and writes one line per object:
+ *
+ *   S3 env vars 2 refs 1 retained 184 path S1.make > F2 make@0 > S3
+ *
+ * Ids are given in the order of the walk and functions are named by their
+ * index in a preorder walk of the program, so censuses of the same program
+ * and input are equal and can be diffed. The path is how the object was
+ * first reached; its retained bytes are its own plus those of the objects
+ * only it holds. Objects alive but not reachable from a root are listed
+ * last as leaked: counting cannot free them, they hold each other.
+ */
+
+// Set by SIGUSR1, the census runs at the next call or loop iteration
+extern volatile std::sig_atomic_t census_requested;
+void request_census(int);
+
+#endif
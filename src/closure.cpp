@@ -0,0 +1,323 @@
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "closure.hpp"
+
+namespace {
+
+// Compile time image of a Scope: the declarations it will hold, in order.
+// Kept alive by the lazy bodies that are resolved in it later.
+struct StaticScope : std::enable_shared_from_this<StaticScope> {
+    std::shared_ptr<StaticScope> outer;
+    size_t visible;
+    Term *frame;              // Function whose call runs in this scope
+    std::vector<Term*> vars;
+
+    StaticScope(StaticScope *s, Term *f = nullptr):
+        outer(s ? s->shared_from_this() : nullptr),
+        visible(s ? s->vars.size() : 0), frame(f) {}
+};
+
+class Converter {
+    std::unordered_set<Term*> assigned, used_as_value, declared;
+    std::unordered_map<Term*, std::vector<Term*>> capturers;
+    std::vector<Term*> functions;
+    // Scope of the lazy body being converted, the functions from it
+    // outwards already have their captures
+    StaticScope *sealed = nullptr;
+
+    // Same rule as Scope::decl_var, redeclaring a name reuses its slot
+    bool declare(Term *name, StaticScope *s) {
+        for (auto v : s->vars) {
+            if (v->sym == name->sym) {
+                name->decl = v;
+                return true;
+            }
+        }
+        s->vars.push_back(name);
+        name->decl = name;
+        declared.insert(name);
+        return false;
+    }
+
+    // Same walk as Scope::find_var, noting every function left on the way
+    Term *resolve(uint32_t sym, StaticScope *s) {
+        std::vector<Term*> crossed;
+        bool open = true;
+        size_t before = s->vars.size();
+        while (s) {
+            auto n = std::min(before, s->vars.size());
+            for (size_t i = 0; i < n; ++i) {
+                if (s->vars[i]->sym != sym) continue;
+                if (s->outer) {
+                    for (auto f : crossed) capture(f, s->vars[i]);
+                }
+                return s->vars[i];
+            }
+            if (s == sealed) open = false;
+            if (s->frame && open) crossed.push_back(s->frame);
+            before = s->visible;
+            s = s->outer.get();
+        }
+        return nullptr;
+    }
+
+    Term *use(Term *ref, StaticScope *s) {
+        return ref->decl = resolve(ref->sym, s);
+    }
+
+    void capture(Term *func, Term *decl) {
+        auto& list = func->captures;
+        if (std::find(list.begin(), list.end(), decl) == list.end()) {
+            list.push_back(decl);
+            capturers[decl].push_back(func);
+        }
+    }
+
+    // Lazy bodies count as escaping, they may define closures that do
+    bool captured_by_escaping(Term *decl) {
+        auto it = capturers.find(decl);
+        if (it == capturers.end()) return false;
+        for (auto f : it->second) {
+            if (f->escapes || f->sons.back()->lazy) return true;
+        }
+        return false;
+    }
+
+    void assign(Term *ref, StaticScope *s) {
+        if (auto decl = use(ref, s)) assigned.insert(decl);
+    }
+
+    void expr(Term *t, StaticScope *s) {
+        if (t->kind == Expr && t->subtype == VarName) {
+            if (auto decl = use(t, s)) used_as_value.insert(decl);
+            return;
+        }
+        auto it = t->sons.begin();
+        if (t->kind == Expr && t->subtype == Apply && it != t->sons.end()) {
+            use(*it++, s);
+        }
+        for (; it != t->sons.end(); ++it) {
+            expr(*it, s);
+        }
+    }
+
+    void block(Term *t, StaticScope *s) {
+        auto child = std::make_shared<StaticScope>(s);
+        body(t, child.get());
+    }
+
+    void function(Term *t, StaticScope *s) {
+        if (t->sons.size() < 2 || t->sons.back()->kind != Block) return;
+        if (declare(t->sons.front(), s)) {
+            // Redefining a function assigns its name
+            assigned.insert(t->sons.front()->decl);
+        }
+        functions.push_back(t);
+
+        // Parameters and the body share the call scope
+        auto frame = std::make_shared<StaticScope>(s, t);
+        auto last = --t->sons.end();
+        for (auto it = ++t->sons.begin(); it != last; ++it) {
+            declare(*it, frame.get());
+        }
+        if (auto lazy = t->sons.back()->lazy.get()) {
+            unparsed(*lazy, frame.get());
+        } else {
+            body(t->sons.back(), frame.get());
+        }
+    }
+
+    // Until it is parsed, a body is assumed to do all its names allow
+    void unparsed(LazyBody& lazy, StaticScope *frame) {
+        lazy.scope = frame->shared_from_this();
+        for (auto sym : lazy.uses) {
+            auto decl = resolve(sym, frame);
+            if (!decl) continue;
+            lazy.reads.push_back(decl);
+            if (std::binary_search(lazy.values.begin(), lazy.values.end(), sym)) {
+                used_as_value.insert(decl);
+            }
+            if (std::binary_search(lazy.assigns.begin(), lazy.assigns.end(), sym)) {
+                assigned.insert(decl);
+                lazy.writes.push_back(decl);
+            }
+        }
+    }
+
+    void body(Term *t, StaticScope *s) {
+        for (auto cmd : t->sons) {
+            if (cmd->kind == Function) {
+                function(cmd, s);
+                continue;
+            }
+            if (cmd->kind != Command) continue;
+            auto it = cmd->sons.begin();
+            switch (cmd->subtype) {
+                case Declaration:
+                    for (auto var : cmd->sons) declare(var, s);
+                    break;
+                case Assign:
+                    if (cmd->sons.size() != 2) break;
+                    expr(cmd->sons.back(), s);
+                    assign(cmd->sons.front(), s);
+                    break;
+                case Read:
+                    if (!cmd->sons.empty()) assign(cmd->sons.front(), s);
+                    break;
+                case Call:
+                    if (it != cmd->sons.end()) use(*it++, s);
+                    for (; it != cmd->sons.end(); ++it) expr(*it, s);
+                    break;
+                case Print:
+                case Return:
+                    for (auto e : cmd->sons) expr(e, s);
+                    break;
+                case If:
+                case While:
+                    for (auto son : cmd->sons) {
+                        if (son->kind == Block) block(son, s);
+                        else expr(son, s);
+                    }
+                    break;
+            }
+        }
+    }
+
+    // Escape analysis and boxing for what this pass declared
+    void finish() {
+        for (auto f : functions) {
+            f->escapes = used_as_value.count(f->sons.front()->decl);
+        }
+        for (bool changed = true; changed; ) {
+            changed = false;
+            for (auto f : functions) {
+                if (!f->escapes && captured_by_escaping(f->sons.front()->decl)) {
+                    f->escapes = changed = true;
+                }
+            }
+        }
+
+        for (auto decl : assigned) {
+            if (declared.count(decl) && captured_by_escaping(decl)) decl->boxed = true;
+        }
+        // An escaping function never reassigned can bind itself when
+        // called instead of capturing itself, which would be a cycle.
+        for (auto f : functions) {
+            auto self = f->sons.front()->decl;
+            auto& list = f->captures;
+            auto it = std::find(list.begin(), list.end(), self);
+            if (f->escapes && it != list.end() && !self->boxed) {
+                list.erase(it);
+                f->selfref = true;
+            }
+        }
+    }
+
+    // Whether every mention in t of the names decls declare is one of them
+    static bool owns_names(Term *t, const std::vector<Term*>& decls) {
+        auto declares = [&](uint32_t sym) {
+            for (auto d : decls) {
+                if (d->sym == sym) return true;
+            }
+            return false;
+        };
+        if (t->kind == Name || (t->kind == Expr && t->subtype == VarName)) {
+            if (declares(t->sym) &&
+                std::find(decls.begin(), decls.end(), t->decl) == decls.end()) {
+                return false;
+            }
+        }
+        if (auto lazy = t->lazy.get()) {
+            for (auto d : decls) {
+                if (std::binary_search(lazy->uses.begin(), lazy->uses.end(), d->sym)) return false;
+            }
+        }
+        for (auto son : t->sons) {
+            if (!owns_names(son, decls)) return false;
+        }
+        return true;
+    }
+
+    // A block runs in the scope of its parent when it declares nothing, or
+    // inside func when its variables are not boxed and no name they share
+    // resolves elsewhere in func, so that keeping them in the parent scope
+    // shadows nothing. Their declarations then reset them to Null.
+    static bool flat(Term *block, Term *func) {
+        std::vector<Term*> decls;
+        for (auto cmd : block->sons) {
+            if (cmd->kind == Function) return false;
+            if (cmd->kind != Command || cmd->subtype != Declaration) continue;
+            for (auto var : cmd->sons) {
+                if (var->decl != var || var->boxed) return false;
+                decls.push_back(var);
+            }
+        }
+        return decls.empty() || (func && owns_names(func, decls));
+    }
+
+    static void flatten(Term *t, Term *func) {
+        for (auto cmd : t->sons) {
+            if (cmd->kind == Function) {
+                if (!cmd->sons.back()->lazy) flatten(cmd->sons.back(), cmd);
+                continue;
+            }
+            if (cmd->kind != Command || (cmd->subtype != If && cmd->subtype != While)) continue;
+            for (auto son : cmd->sons) {
+                if (son->kind != Block) continue;
+                son->flat = flat(son, func);
+                flatten(son, func);
+            }
+        }
+    }
+
+    public:
+    void run(Term *program) {
+        auto globals = std::make_shared<StaticScope>(nullptr);
+        body(program, globals.get());
+        finish();
+        flatten(program, nullptr);
+    }
+
+    // Later items may use a global function in any way
+    void run_items(Term *block, StaticScope *globals) {
+        body(block, globals);
+        for (auto cmd : block->sons) {
+            if (cmd->kind == Function) used_as_value.insert(cmd->sons.front()->decl);
+        }
+        finish();
+        flatten(block, nullptr);
+    }
+
+    // Declarations outside the body keep what the whole program pass
+    // decided for them, parameters are only bound once it is loaded
+    void run_body(Term *func) {
+        auto frame = std::static_pointer_cast<StaticScope>(func->sons.back()->lazy->scope);
+        sealed = frame.get();
+        declared.insert(frame->vars.begin(), frame->vars.end());
+        body(func->sons.back(), frame.get());
+        finish();
+        flatten(func->sons.back(), func);
+    }
+};
+
+}
+
+void convert_closures(Term *program) {
+    if (!program || program->kind != Block) return;
+    Converter().run(program);
+}
+
+void convert_body(Term *func) {
+    Converter().run_body(func);
+}
+
+std::shared_ptr<void> global_scope() {
+    return std::make_shared<StaticScope>(nullptr);
+}
+
+void convert_items(Term *block, const std::shared_ptr<void>& globals) {
+    Converter().run_items(block, static_cast<StaticScope*>(globals.get()));
+}
@@ -0,0 +1,38 @@
+#ifndef ZITP_CLOSURE_H
+#define ZITP_CLOSURE_H
+
+#include "Term.hpp"
+
+/*
+ * Free variable analysis for flat closures.
+ *
+ * Resolves every name to the Name term that declares it, following the same
+ * visibility rules as Scope::find_var, and gives each Function the list of
+ * variables it has to capture. Globals are never captured since the global
+ * scope outlives every closure.
+ *
+ * Escape analysis then marks the functions that may outlive the block
+ * defining them: those whose name is used as a value, or that are captured
+ * by another escaping function. Only escaping functions need their own
+ * captured environment; the others are called through the defining scope.
+ * A variable captured by an escaping function and also assigned is marked
+ * boxed so that the closure and its defining scope share it.
+ *
+ * Blocks of an If or While that declare nothing, or whose variables can
+ * live in the enclosing scope without shadowing anything, are marked flat
+ * and run without a scope of their own.
+ *
+ * A body parse_lazy() skipped is assumed to use, capture and assign every
+ * name it mentions, and to define escaping closures. convert_body() runs
+ * the pass on it once parsed, leaving the declarations outside it alone.
+ */
+void convert_closures(Term *program);
+void convert_body(Term *func);
+
+// For programs converted a few top-level items at a time, see stream.hpp:
+// the global scope they are resolved in, kept between calls. Global
+// functions are assumed to escape.
+std::shared_ptr<void> global_scope();
+void convert_items(Term *block, const std::shared_ptr<void>& globals);
+
+#endif
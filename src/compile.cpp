@@ -0,0 +1,516 @@
+#include <functional>
+
+#include "compile.hpp"
+#include "zitp.hpp"
+
+using std::cerr;
+using std::endl;
+
+#define is_boxed(name) ((name)->decl && (name)->decl->boxed)
+
+struct CompiledHandlers {
+    // Expressions
+
+    static i32 number_int(Compiled&, const Code *c, Scope*) {
+        return c->number;
+    }
+    static Ref<Value> number_value(Compiled&, const Code *c, Scope*) {
+        return make_ref<IntValue>(c->number);
+    }
+
+    static i32 var_int(Compiled&, const Code *c, Scope *s) {
+        return static_cast<const IntValue*>(s->get_val(c->sym).get())->value();
+    }
+    static i32 var_checked(Compiled&, const Code *c, Scope *s) {
+        return Zitp::checked_int(s->get_val(c->sym), c->term);
+    }
+    static Ref<Value> var_value(Compiled&, const Code *c, Scope *s) {
+        const auto& var = s->get_val(c->sym);
+        if (var && var->kind == Null) {
+            cerr << "ERROR: Invalid kind of var: " << c->term->name() << endl;
+        }
+        return var;
+    }
+
+    // Operands are evaluated left to right, calls in them may assign
+    template <class Op>
+    static i32 arith(Compiled& e, const Code *c, Scope *s) {
+        i32 l = c->a->as_int(e, c->a, s);
+        return Op()(l, c->b->as_int(e, c->b, s));
+    }
+    template <class Op>
+    static i32 divide(Compiled& e, const Code *c, Scope *s) {
+        i32 l = c->a->as_int(e, c->a, s);
+        i32 r = c->b->as_int(e, c->b, s);
+        if (r == 0) {
+            throw RuntimeError("integer division or modulo by zero");
+        }
+        return Op()(l, r);
+    }
+    static Ref<Value> int_value(Compiled& e, const Code *c, Scope *s) {
+        return make_ref<IntValue>(c->as_int(e, c, s));
+    }
+
+    static Ref<Value> apply(Compiled& e, const Code *c, Scope *s) {
+        return e.call(c, s);
+    }
+    static i32 apply_int(Compiled& e, const Code *c, Scope *s) {
+        return Zitp::checked_int(e.call(c, s), c->term);
+    }
+
+    template <class Op>
+    static bool compare(Compiled& e, const Code *c, Scope *s) {
+        i32 l = c->a->as_int(e, c->a, s);
+        return Op()(l, c->b->as_int(e, c->b, s));
+    }
+    static bool both(Compiled& e, const Code *c, Scope *s) {
+        return c->a->as_bool(e, c->a, s) && c->b->as_bool(e, c->b, s);
+    }
+    static bool either(Compiled& e, const Code *c, Scope *s) {
+        return c->a->as_bool(e, c->a, s) || c->b->as_bool(e, c->b, s);
+    }
+    static bool negate(Compiled& e, const Code *c, Scope *s) {
+        return !c->a->as_bool(e, c->a, s);
+    }
+    static Ref<Value> bool_value(Compiled& e, const Code *c, Scope *s) {
+        return e.z.bools[c->as_bool(e, c, s)];
+    }
+
+    // Statements
+
+    static bool define(Compiled& e, const Code *c, Scope *root) {
+        root->decl_var(c->sym, is_boxed(c->term->sons.front()));
+        auto fv = e.z.make_closure(c->term, root);
+        static_cast<FuncValue*>(fv.get())->code = c;
+        root->set_var(c->sym, std::move(fv));
+        return false;
+    }
+    static bool declare(Compiled&, const Code *c, Scope *root) {
+        for (auto var : c->names) {
+            root->decl_var(var->sym, is_boxed(var));
+        }
+        return false;
+    }
+    static bool renew(Compiled&, const Code *c, Scope *root) {
+        for (auto var : c->names) {
+            root->renew_var(var->sym);
+        }
+        return false;
+    }
+    // Runs the block of an If or While, in a scope of its own unless flat
+    static bool nested(Compiled& e, const Code *block, Scope *root) {
+        if (block->term->flat) return e.run_block(block, root);
+        Scope born(root, root->count_vars());
+        return e.run_block(block, &born);
+    }
+    static bool assign(Compiled& e, const Code *c, Scope *root) {
+        root->set_var(c->sym, c->a->as_value(e, c->a, root));
+        return false;
+    }
+    static bool read(Compiled& e, const Code *c, Scope *root) {
+        if (e.z.snapshot_pending) e.z.take_snapshot(c->term, root);
+        root->set_var(c->sym, make_ref<IntValue>(e.z.read_int()));
+        return false;
+    }
+    static bool print_int(Compiled& e, const Code *c, Scope *root) {
+        e.z.print_int(c->a->as_int(e, c->a, root));
+        return false;
+    }
+    static bool print_value(Compiled& e, const Code *c, Scope *root) {
+        auto res = c->a->as_value(e, c->a, root);
+        if (res && res->kind == Integer) {
+            e.z.print_int(static_cast<const IntValue*>(res.get())->value());
+        }
+        return false;
+    }
+    static bool call(Compiled& e, const Code *c, Scope *root) {
+        e.call(c, root);
+        return false;
+    }
+    static bool branch(Compiled& e, const Code *c, Scope *root) {
+        bool cond = c->a->as_bool(e, c->a, root);
+        return nested(e, cond ? c->b : c->c, root);
+    }
+    static bool loop(Compiled& e, const Code *c, Scope *root) {
+        while (c->a->as_bool(e, c->a, root)) {
+            e.z.tick();
+            if (nested(e, c->b, root)) return true;
+        }
+        return false;
+    }
+    // Fused forms, see Compiled::fuse()
+
+    static bool increment(Compiled& e, const Code *c, Scope *root) {
+        ++e.z.fusion.increment;
+        Ref<Value>& var = root->var(c->sym);
+        if (var->kind == Integer && var->refs == 1) {
+            auto iv = static_cast<IntValue*>(var.get());
+            iv->set(iv->value() + c->number);
+            return false;
+        }
+        var = make_ref<IntValue>(Zitp::checked_int(var, c->a->term) + c->number);
+        return false;
+    }
+
+    // Operands of a fused comparison
+    struct Var {
+        static i32 get(const Code *c, Scope *root) {
+            return static_cast<const IntValue*>(root->get_val(c->sym).get())->value();
+        }
+    };
+    struct Const {
+        static i32 get(const Code *c, Scope*) {
+            return c->number;
+        }
+    };
+
+    template <class L, class R>
+    static bool loop_lt(Compiled& e, const Code *c, Scope *root) {
+        for (;;) {
+            ++e.z.fusion.loop_lt;
+            if (!(L::get(c->a, root) < R::get(c->b, root))) return false;
+            e.z.tick();
+            if (nested(e, c->c, root)) return true;
+        }
+    }
+
+    static bool if_divisible(Compiled& e, const Code *c, Scope *root) {
+        ++e.z.fusion.if_divisible;
+        i32 l = c->a->as_int(e, c->a, root);
+        i32 r = c->b->as_int(e, c->b, root);
+        if (r == 0) {
+            throw RuntimeError("integer division or modulo by zero");
+        }
+        return nested(e, l % r == 0 ? c->c->a : c->c->b, root);
+    }
+
+    static bool return_call(Compiled& e, const Code *c, Scope *root) {
+        ++e.z.fusion.return_call;
+        e.result = e.call(c->a, root);
+        return true;
+    }
+
+    static bool ret(Compiled& e, const Code *c, Scope *root) {
+        auto v = c->a->as_value(e, c->a, root);
+        // An unassigned variable has nothing to return
+        if (!v || v->kind == Null) {
+            throw RuntimeError("Return unexpected value");
+        }
+        e.result = std::move(v);
+        return true;
+    }
+};
+
+Compiled::Compiled(Zitp& zitp, Term *ast): z(zitp) {
+    program = block(ast);
+}
+
+Code* Compiled::node(Term *t) {
+    arena->emplace_back();
+    Code *c = &arena->back();
+    c->term = t;
+    return c;
+}
+
+const Code* Compiled::block(Term *t) {
+    if (t->kind != Block) {
+        throw RuntimeError("Not a Block");
+    }
+    Code *c = node(t);
+    for (auto cmd : t->sons) {
+        c->list.push_back(cmd->kind == Function ? function(cmd) : statement(cmd));
+    }
+    return c;
+}
+
+const Code* Compiled::function(Term *t) {
+    Code *c = node(t);
+    c->exec = CompiledHandlers::define;
+    c->sym = t->sons.front()->sym;
+    auto last = --t->sons.end();
+    for (auto it = ++t->sons.begin(); it != last; ++it) {
+        c->names.push_back(*it);
+    }
+    // Compiled on the first call when the body is not parsed yet
+    c->a = (*last)->lazy ? nullptr : block(*last);
+    defined[t] = c;
+    return c;
+}
+
+static bool is_number(Term *t, i32 n) {
+    return t->kind == Expr && t->subtype == Number && t->number == n;
+}
+
+// Variables known to hold integers and constants, the operands fused
+// comparisons read directly
+static bool is_operand(Term *t) {
+    if (t->kind != Expr) return false;
+    return t->subtype == Number ||
+           (t->subtype == VarName && (t->type == IntType || t->type == NoType));
+}
+
+template <class L>
+static Code::ExecFn loop_lt(Term *r) {
+    typedef CompiledHandlers H;
+    if (r->subtype == Number) return H::loop_lt<L, H::Const>;
+    return H::loop_lt<L, H::Var>;
+}
+
+// The fused form of a statement, or nullptr if it has none
+const Code* Compiled::fuse(Term *t) {
+    typedef CompiledHandlers H;
+    auto it = t->sons.begin();
+    switch (t->subtype) {
+        case Assign: {
+            // Assign x Plus x <n>, Assign x Plus <n> x, Assign x Minus x <n>
+            Term *name = *it, *e = *++it;
+            if (e->kind != Expr || (e->subtype != Plus && e->subtype != Minus)) break;
+            Term *l = e->sons.front(), *r = e->sons.back();
+            if (e->subtype == Plus && l->subtype == Number) std::swap(l, r);
+            if (l->kind != Expr || l->subtype != VarName || l->sym != name->sym) break;
+            if (r->kind != Expr || r->subtype != Number) break;
+            if (e->subtype == Minus && r->number == INT32_MIN) break;
+            Code *c = node(t);
+            c->exec = H::increment;
+            c->sym = name->sym;
+            c->number = e->subtype == Plus ? r->number : -r->number;
+            c->a = expr(l);
+            return c;
+        }
+        case While: {
+            Term *cond = *it;
+            if (cond->kind != BoolExpr || cond->subtype != Lt) break;
+            Term *l = cond->sons.front(), *r = cond->sons.back();
+            if (!is_operand(l) || !is_operand(r)) break;
+            Code *c = node(t);
+            c->exec = l->subtype == Number ? loop_lt<H::Const>(r) : loop_lt<H::Var>(r);
+            c->a = expr(l);
+            c->b = expr(r);
+            c->c = block(*++it);
+            return c;
+        }
+        case If: {
+            // If Eq Mod a b 0, either way round
+            Term *cond = *it;
+            if (cond->kind != BoolExpr || cond->subtype != Eq) break;
+            Term *l = cond->sons.front(), *r = cond->sons.back();
+            if (is_number(l, 0)) std::swap(l, r);
+            if (!is_number(r, 0) || l->kind != Expr || l->subtype != Mod) break;
+            Code *c = node(t);
+            Code *branches = node(t);
+            c->exec = H::if_divisible;
+            c->a = expr(l->sons.front());
+            c->b = expr(l->sons.back());
+            branches->a = block(*++it);
+            branches->b = block(*++it);
+            c->c = branches;
+            return c;
+        }
+        case Return: {
+            Term *e = *it;
+            if (e->kind != Expr || e->subtype != Apply) break;
+            Code *c = node(t);
+            c->exec = H::return_call;
+            c->a = expr(e);
+            return c;
+        }
+        default:
+            break;
+    }
+    return nullptr;
+}
+
+const Code* Compiled::statement(Term *t) {
+    typedef CompiledHandlers H;
+    if (t->kind == Command) {
+        if (auto fused = fuse(t)) return fused;
+    }
+    Code *c = node(t);
+    if (t->kind != Command) {
+        c->exec = H::declare;
+        return c;
+    }
+    auto it = t->sons.begin();
+    switch (t->subtype) {
+        case Declaration:
+            c->exec = t->father->flat ? H::renew : H::declare;
+            c->names.assign(t->sons.begin(), t->sons.end());
+            break;
+        case Assign:
+            c->exec = H::assign;
+            c->sym = (*it)->sym;
+            c->a = expr(*++it);
+            break;
+        case Read:
+            c->exec = H::read;
+            c->sym = (*it)->sym;
+            break;
+        case Print:
+            // A variable typed Int may still be unassigned, which prints nothing
+            c->a = expr(*it);
+            c->exec = (*it)->type == IntType && (*it)->subtype != VarName
+                      ? H::print_int : H::print_value;
+            break;
+        case Call:
+            c->exec = H::call;
+            c->sym = (*it)->sym;
+            for (++it; it != t->sons.end(); ++it) c->list.push_back(expr(*it));
+            break;
+        case If:
+            c->exec = H::branch;
+            c->a = expr(*it);
+            c->b = block(*++it);
+            c->c = block(*++it);
+            break;
+        case While:
+            c->exec = H::loop;
+            c->a = expr(*it);
+            c->b = block(*++it);
+            break;
+        case Return:
+            c->exec = H::ret;
+            c->a = expr(*it);
+            break;
+        default:
+            throw RuntimeError("Invalid command: " + std::to_string(t->subtype));
+    }
+    return c;
+}
+
+const Code* Compiled::expr(Term *t) {
+    typedef CompiledHandlers H;
+    Code *c = node(t);
+    if (t->kind == BoolExpr) {
+        c->as_value = H::bool_value;
+        c->a = expr(t->sons.front());
+        c->b = expr(t->sons.back());
+        switch (t->subtype) {
+            case Lt: c->as_bool = H::compare<std::less<i32>>; break;
+            case Gt: c->as_bool = H::compare<std::greater<i32>>; break;
+            case Eq: c->as_bool = H::compare<std::equal_to<i32>>; break;
+            case And: c->as_bool = H::both; break;
+            case Or: c->as_bool = H::either; break;
+            case Negb: c->as_bool = H::negate; break;
+            default:
+                throw RuntimeError("Invalid bool expr: " + std::to_string(t->subtype));
+        }
+        return c;
+    }
+
+    c->as_value = H::int_value;
+    switch (t->subtype) {
+        case Number:
+            c->number = t->number;
+            c->as_int = H::number_int;
+            c->as_value = H::number_value;
+            return c;
+        case VarName:
+            c->sym = t->sym;
+            c->as_int = t->type == DynType ? H::var_checked : H::var_int;
+            c->as_value = H::var_value;
+            return c;
+        case Apply: {
+            auto it = t->sons.begin();
+            c->sym = (*it)->sym;
+            for (++it; it != t->sons.end(); ++it) c->list.push_back(expr(*it));
+            c->as_int = H::apply_int;
+            c->as_value = H::apply;
+            return c;
+        }
+        default:
+            break;
+    }
+    c->a = expr(t->sons.front());
+    c->b = expr(t->sons.back());
+    switch (t->subtype) {
+        case Plus: c->as_int = H::arith<std::plus<i32>>; break;
+        case Minus: c->as_int = H::arith<std::minus<i32>>; break;
+        case Mult: c->as_int = H::arith<std::multiplies<i32>>; break;
+        case Div: c->as_int = H::divide<std::divides<i32>>; break;
+        case Mod: c->as_int = H::divide<std::modulus<i32>>; break;
+        default:
+            throw RuntimeError("Invalid expr: " + std::to_string(t->kind));
+    }
+    return c;
+}
+
+bool Compiled::run_block(const Code *block, Scope *root) {
+    Zitp::FrameMark mark(z.frames, root);
+    for (auto st : block->list) {
+        if (st->exec(*this, st, root)) return true;
+    }
+    return false;
+}
+
+Ref<Value> Compiled::call(const Code *c, Scope *current) {
+    z.tick();
+    Zitp::CallDepth guard(z);
+    Ref<Value> var = current->get_val(c->sym);
+    if (!var || var->kind != Func) {
+        throw RuntimeError(c->term->sons.front()->name() + " is not a function");
+    }
+    auto fv = static_cast<const FuncValue*>(var.get());
+    const Code *func = fv->code;
+    if (func->names.size() != c->list.size()) {
+        throw RuntimeError("Different size: vars size: "
+                           + std::to_string(func->names.size() + 1)
+                           + ", exprs size: "
+                           + std::to_string(c->list.size() + 1));
+    }
+
+    if (!func->a) {
+        if (func->term->sons.back()->lazy) Zitp::load_body(func->term);
+        // Nodes are owned by this Compiled, only their users see them const.
+        // Bodies live as long as their function, whatever item is running.
+        auto running = arena;
+        arena = &nodes;
+        const_cast<Code*>(func)->a = block(func->term->sons.back());
+        arena = running;
+    }
+
+    Scope frame(fv->outer.get(), fv->visible);
+    if (func->term->frame) frame.reserve(func->term->frame);
+    if (func->term->selfref) {
+        frame.decl_var(func->sym);
+        frame.set_var(func->sym, var);
+    }
+    for (usize i = 0; i < c->list.size(); ++i) {
+        Term *param = func->names[i];
+        frame.decl_var(param->sym, is_boxed(param));
+        frame.set_var(param->sym, c->list[i]->as_value(*this, c->list[i], current));
+    }
+    auto body = [&]() -> Ref<Value> {
+        if (!run_block(func->a, &frame)) {
+            return make_ref<IntValue>(0);
+        }
+        return std::move(result);
+    };
+    return func->term->observed ? z.observe_call(func->term, &frame, body) : body();
+}
+
+void FusionStats::print(std::ostream& os) const {
+    os << "fused increment: " << increment << endl
+       << "fused while-lt: " << loop_lt << endl
+       << "fused if-divisible: " << if_divisible << endl
+       << "fused return-call: " << return_call << endl;
+}
+
+void Compiled::run(Scope *top, usize from) {
+    Zitp::FrameMark mark(z.frames, top);
+    for (usize i = from; i < program->list.size(); ++i) {
+        auto st = program->list[i];
+        if (st->exec(*this, st, top)) return;
+    }
+}
+
+bool Compiled::run(Term *items, Scope *top) {
+    Code batch;
+    batch.term = items;
+    for (auto item : items->sons) {
+        // Kept apart so forget() can free them once the item ran
+        arena = &streamed[item];
+        batch.list.push_back(item->kind == Function ? function(item) : statement(item));
+        arena = &nodes;
+    }
+    return run_block(&batch, top);
+}
@@ -0,0 +1,88 @@
+#ifndef ZITP_COMPILE_H
+#define ZITP_COMPILE_H
+
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include "Term.hpp"
+#include "value.hpp"
+
+class Zitp;
+class Compiled;
+
+/*
+ * A Term compiled to callables.
+ *
+ * Each node keeps the handlers it can be run through, picked once per
+ * subtype and static type when compiling, and direct pointers to its
+ * children. Running a node is an indirect call, the evaluator never looks
+ * at kind or subtype again. Expressions have an integer, boolean or boxed
+ * form; statements an exec handler returning true to leave their block.
+ */
+struct Code {
+    typedef i32 (*IntFn)(Compiled&, const Code*, Scope*);
+    typedef bool (*BoolFn)(Compiled&, const Code*, Scope*);
+    typedef Ref<Value> (*ValueFn)(Compiled&, const Code*, Scope*);
+    typedef bool (*ExecFn)(Compiled&, const Code*, Scope*);
+
+    IntFn as_int = nullptr;
+    BoolFn as_bool = nullptr;
+    ValueFn as_value = nullptr;
+    ExecFn exec = nullptr;
+
+    const Code *a = nullptr, *b = nullptr, *c = nullptr;
+    std::vector<const Code*> list;  // Statements of a block, arguments of a call
+    std::vector<Term*> names;       // Declared variables, parameters of a function
+    i32 number = 0;
+    u32 sym = 0;
+    Term *term = nullptr;
+};
+
+// How often each fused form ran, see Compiled::statement()
+struct FusionStats {
+    u64 increment = 0;      // Assign x Plus x <n>, Assign x Minus x <n>
+    u64 loop_lt = 0;        // While Lt <var|n> <var|n>, once per test
+    u64 if_divisible = 0;   // If Eq Mod a b 0
+    u64 return_call = 0;    // Return Apply f Argus ... End
+
+    void print(std::ostream& os) const;
+};
+
+// Compiles a program once and runs it with the state of a Zitp
+class Compiled {
+    Zitp& z;
+    std::deque<Code> nodes;
+    // Where node() allocates: nodes, or the code of a streamed item
+    std::deque<Code> *arena = &nodes;
+    std::unordered_map<Term*, std::deque<Code>> streamed;
+    const Code *program;
+    std::unordered_map<Term*, const Code*> defined;
+    // Value of the last Return, taken by the call it returns from
+    Ref<Value> result;
+
+    Code* node(Term *t);
+    const Code* block(Term *t);
+    const Code* function(Term *t);
+    const Code* statement(Term *t);
+    const Code* fuse(Term *t);
+    const Code* expr(Term *t);
+
+    bool run_block(const Code *block, Scope *root);
+    Ref<Value> call(const Code *c, Scope *current);
+
+    friend struct CompiledHandlers;
+
+    public:
+    Compiled(Zitp& z, Term *ast);
+    // Runs the program from its top-level command at index from
+    void run(Scope *top, usize from = 0);
+    // The compiled body of a Function term
+    const Code* code_of(Term *func) const { return defined.at(func); }
+    // Compiles more top-level items and runs them, true if one returned
+    bool run(Term *items, Scope *top);
+    // Frees the code of an item run above, which nothing may point into
+    void forget(Term *item) { streamed.erase(item); }
+};
+
+#endif
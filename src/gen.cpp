@@ -0,0 +1,721 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <getopt.h>
+
+/*
+ * zitp-gen, random Minilan programs for differential testing.
+ *
+ * Programs follow the grammar in the README and pass the type checker:
+ * every variable holds only integers or only functions taking one integer,
+ * functions are called with as many arguments as they take, and values are
+ * kept small enough that no operator overflows. They always end, since
+ * loops count up to a bound and recursive functions count down a parameter
+ * checked on entry. A few divisions are left unguarded so some runs fail.
+ * Some locals are left unassigned or assigned in one branch only, so reads
+ * see them unassigned and some functions return them unassigned, and some
+ * recursions go deep enough to hit the limit of a run under --max-depth.
+ *
+ * With --reduce the program is shrunk instead of written right away: nodes
+ * are removed or replaced by simpler ones for as long as the command, run
+ * with the path of the smaller program appended, still exits with 0.
+ */
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+
+namespace {
+
+struct Options {
+    unsigned seed = 1;
+    unsigned depth = 3;             // Blocks nested in blocks
+    unsigned width = 4;             // Commands per block
+    unsigned functions = 3;         // Functions of the top-level block
+    unsigned closures = 30;         // Percent of functions capturing or making closures
+    unsigned recursion = 30;        // Percent of functions calling themselves
+    unsigned recursion_depth = 6;   // Deepest a recursion goes
+    unsigned deep = 30;             // Percent of recursions going deep_depth deep
+    unsigned deep_depth = 300;      // Deepest a deep recursion goes, calling itself once
+    unsigned trips = 8;             // Most iterations of a loop
+    unsigned unassigned = 10;       // Percent of locals maybe left unassigned
+};
+
+// What every variable is kept below, so a product of two fits an i32
+const long cap = 10007;
+
+struct Node {
+    enum Shape { Block, Command, Expr, Cond } shape;
+    string head, tail;
+    vector<Node> sons;
+};
+
+Node leaf(Node::Shape shape, const string& head) {
+    return Node{shape, head, "", {}};
+}
+
+Node node(Node::Shape shape, const string& head, vector<Node> sons, const string& tail = "") {
+    return Node{shape, head, tail, std::move(sons)};
+}
+
+void print(const Node& n, std::ostream& os, unsigned indent) {
+    string pad(indent * 4, ' ');
+    if (n.shape == Node::Block) {
+        os << "Begin\n";
+        for (auto& son : n.sons) {
+            os << pad << "    ";
+            print(son, os, indent + 1);
+            os << "\n";
+        }
+        os << pad << "End";
+        return;
+    }
+    os << n.head;
+    for (size_t i = 0; i < n.sons.size(); ++i) {
+        if (n.head == "If" && i == 2) os << " Else";
+        os << " ";
+        print(n.sons[i], os, indent);
+    }
+    if (!n.tail.empty()) os << " " << n.tail;
+}
+
+string text(const Node& program) {
+    std::ostringstream os;
+    print(program, os, 0);
+    os << "\n";
+    return os.str();
+}
+
+class Generator {
+    // Only unary functions from integers to integers are passed around
+    struct Function {
+        string name;
+        vector<char> params;        // 'i' an integer, 'f' a function
+        char result;
+        bool recursive;
+        unsigned depth = 0;         // Deepest its recursion goes
+    };
+    struct Env {
+        vector<string> ints;        // Integers that may be assigned
+        vector<string> counters;    // Loop counters and recursion bounds, only read
+        vector<string> funcs;       // Variables holding a function
+        vector<Function> functions;
+        const Function *self = nullptr;
+        string bound;               // The parameter a recursion counts down
+        bool in_function = false;
+        bool in_loop = false;
+    };
+
+    const Options& o;
+    std::mt19937 rng;
+    unsigned names = 0;
+    vector<string> *declared = nullptr;     // Locals of the block being made
+    unsigned self_calls = 0;                // Of the recursive function being made
+
+    unsigned pick(unsigned n) { return n ? rng() % n : 0; }
+    bool chance(unsigned percent) { return pick(100) < percent; }
+
+    string name(const char *prefix) {
+        string s = prefix;
+        for (unsigned n = names++; ; n /= 26) {
+            s += char('a' + n % 26);
+            if (n < 26) break;
+        }
+        return s;
+    }
+
+    static bool unary(const Function& f) {
+        return f.params.size() == 1 && f.params[0] == 'i' && f.result == 'i' && !f.recursive;
+    }
+
+    Node capped(Node e, long bound) {
+        if (bound <= cap) return e;
+        return node(Node::Expr, "Mod", {std::move(e), leaf(Node::Expr, std::to_string(cap))});
+    }
+
+    Node number(long max) {
+        return leaf(Node::Expr, std::to_string(pick(max)));
+    }
+
+    // A function value of one integer parameter, an empty head if there is none
+    Node unary_value(Env& env, unsigned depth) {
+        vector<Node> options;
+        for (auto& f : env.functions) {
+            if (unary(f)) options.push_back(leaf(Node::Expr, f.name));
+        }
+        for (auto& v : env.funcs) options.push_back(leaf(Node::Expr, v));
+        for (auto& f : env.functions) {
+            // Makers may take functions too, so this ends
+            if (f.result != 'f' || depth == 0) continue;
+            options.push_back(apply(env, f, depth - 1));
+        }
+        if (options.empty()) return leaf(Node::Expr, "");
+        return options[pick(options.size())];
+    }
+
+    Node apply(Env& env, const Function& f, unsigned depth) {
+        vector<Node> args;
+        for (size_t i = 0; i < f.params.size(); ++i) {
+            if (f.params[i] == 'f') {
+                args.push_back(unary_value(env, depth));
+                continue;
+            }
+            long bound;
+            Node e = expr(env, depth, bound);
+            if (i == 0 && f.recursive) {
+                // Counts down from at most its depth, a deep one mostly from near it
+                e = node(Node::Expr, "Mod", {std::move(e),
+                         leaf(Node::Expr, std::to_string(f.depth + 1))});
+                if (f.depth > o.recursion_depth) {
+                    e = node(Node::Expr, "Minus", {leaf(Node::Expr, std::to_string(f.depth)), std::move(e)});
+                }
+            } else {
+                e = capped(std::move(e), bound);
+            }
+            args.push_back(std::move(e));
+        }
+        return node(Node::Expr, "Apply " + f.name + " Argus", std::move(args), "End");
+    }
+
+    Node self_call(Env& env, unsigned depth) {
+        ++self_calls;
+        vector<Node> args;
+        args.push_back(node(Node::Expr, "Minus", {leaf(Node::Expr, env.bound),
+                            leaf(Node::Expr, std::to_string(1 + pick(2)))}));
+        for (size_t i = 1; i < env.self->params.size(); ++i) {
+            if (env.self->params[i] == 'f') {
+                args.push_back(unary_value(env, depth));
+                continue;
+            }
+            long bound;
+            Node e = expr(env, depth, bound);
+            args.push_back(capped(std::move(e), bound));
+        }
+        return node(Node::Expr, "Apply " + env.self->name + " Argus", std::move(args), "End");
+    }
+
+    public:
+    Generator(const Options& opts): o(opts), rng(opts.seed) {}
+
+    // An integer expression, bound is more than any value it takes
+    Node expr(Env& env, unsigned depth, long& bound) {
+        if (depth == 0 || chance(30)) {
+            size_t vars = env.ints.size() + env.counters.size();
+            if (vars && chance(70)) {
+                size_t i = pick(vars);
+                if (i < env.ints.size()) {
+                    bound = cap;
+                    return leaf(Node::Expr, env.ints[i]);
+                }
+                bound = std::max({o.trips, o.recursion_depth, o.deep_depth}) + 1;
+                return leaf(Node::Expr, env.counters[i - env.ints.size()]);
+            }
+            bound = 100;
+            return number(100);
+        }
+        unsigned what = pick(100);
+        if (what < 15) {
+            vector<const Function*> callees;
+            for (auto& f : env.functions) {
+                if (f.result == 'i') callees.push_back(&f);
+            }
+            // A deep recursion calls itself once, or it would never end
+            unsigned most = env.self && env.self->depth > o.recursion_depth ? 1 : 2;
+            bool self = env.self && !env.in_loop && self_calls < most;
+            if (self && chance(50)) {
+                bound = cap;
+                return self_call(env, depth - 1);
+            }
+            if (!callees.empty()) {
+                bound = cap;
+                return apply(env, *callees[pick(callees.size())], depth - 1);
+            }
+        }
+        if (what < 22 && !env.funcs.empty()) {
+            long b;
+            Node arg = expr(env, depth - 1, b);
+            bound = cap;
+            return node(Node::Expr, "Apply " + env.funcs[pick(env.funcs.size())] + " Argus",
+                        {capped(std::move(arg), b)}, "End");
+        }
+        long lb, rb;
+        Node l = expr(env, depth - 1, lb);
+        Node r = expr(env, depth - 1, rb);
+        if (lb * rb >= (1L << 30)) {
+            l = capped(std::move(l), lb);
+            r = capped(std::move(r), rb);
+            lb = std::min(lb, cap);
+            rb = std::min(rb, cap);
+        }
+        if (what < 40) {
+            bound = lb * rb;
+            return node(Node::Expr, "Mult", {std::move(l), std::move(r)});
+        }
+        if (what < 55) {
+            // Mostly by 1 to 14, now and then by whatever r is
+            if (!chance(4)) {
+                r = node(Node::Expr, "Plus", {node(Node::Expr, "Mod", {std::move(r),
+                         leaf(Node::Expr, "7")}), leaf(Node::Expr, "8")});
+                rb = 15;
+            }
+            bool div = chance(50);
+            bound = div ? lb : std::min(lb, rb);
+            return node(Node::Expr, div ? "Div" : "Mod", {std::move(l), std::move(r)});
+        }
+        bound = lb + rb;
+        return node(Node::Expr, what < 80 ? "Plus" : "Minus", {std::move(l), std::move(r)});
+    }
+
+    Node cond(Env& env, unsigned depth) {
+        if (depth > 0 && chance(25)) {
+            unsigned what = pick(3);
+            if (what == 2) return node(Node::Cond, "Negb", {cond(env, depth - 1)});
+            return node(Node::Cond, what ? "Or" : "And", {cond(env, depth - 1), cond(env, depth - 1)});
+        }
+        long b;
+        const char *ops[] = {"Lt", "Gt", "Eq"};
+        Node l = expr(env, depth, b);
+        Node r = expr(env, depth, b);
+        return node(Node::Cond, ops[pick(3)], {std::move(l), std::move(r)});
+    }
+
+    Node assign(Env& env, const string& var, unsigned depth) {
+        long bound;
+        Node e = expr(env, depth, bound);
+        return node(Node::Command, "Assign " + var, {capped(std::move(e), bound)});
+    }
+
+    void command(Env& env, unsigned depth, vector<Node>& out) {
+        unsigned what = pick(100);
+        if (what < 12 && depth > 0) {
+            Node c = cond(env, 2);
+            Node then = block(env, depth - 1);
+            Node other = block(env, depth - 1);
+            out.push_back(node(Node::Command, "If", {std::move(c), std::move(then), std::move(other)}));
+            return;
+        }
+        if (what < 22 && depth > 0) {
+            string counter = name("i");
+            declared->push_back(counter);
+            out.push_back(node(Node::Command, "Assign " + counter, {leaf(Node::Expr, "0")}));
+            Env inner = env;
+            inner.counters.push_back(counter);
+            inner.in_loop = true;
+            Node c = node(Node::Cond, "Lt", {leaf(Node::Expr, counter), number(o.trips + 1)});
+            if (chance(20)) c = node(Node::Cond, "And", {std::move(c), cond(inner, 1)});
+            Node body = block(inner, depth - 1);
+            body.sons.push_back(node(Node::Command, "Assign " + counter,
+                                     {node(Node::Expr, "Plus", {leaf(Node::Expr, counter), leaf(Node::Expr, "1")})}));
+            out.push_back(node(Node::Command, "While", {std::move(c), std::move(body)}));
+            return;
+        }
+        if (what < 30) {
+            long bound;
+            out.push_back(node(Node::Command, "Print", {expr(env, 2, bound)}));
+            return;
+        }
+        if (what < 35 && !env.functions.empty()) {
+            auto& f = env.functions[pick(env.functions.size())];
+            Node call = apply(env, f, 2);
+            call.shape = Node::Command;
+            call.head = "Call " + f.name + " Argus";
+            out.push_back(std::move(call));
+            return;
+        }
+        if (what < 39 && !env.funcs.empty()) {
+            Node v = unary_value(env, 2);
+            out.push_back(node(Node::Command, "Assign " + env.funcs[pick(env.funcs.size())], {std::move(v)}));
+            return;
+        }
+        if (what < 41 && !env.ints.empty()) {
+            out.push_back(leaf(Node::Command, "Read " + env.ints[pick(env.ints.size())]));
+            return;
+        }
+        if (what < 44 && (env.in_function || what < 42)) {
+            long bound;
+            Node e = expr(env, 2, bound);
+            out.push_back(node(Node::Command, "Return", {capped(std::move(e), bound)}));
+            return;
+        }
+        if (env.ints.empty()) return;
+        out.push_back(assign(env, env.ints[pick(env.ints.size())], 2));
+    }
+
+    Node function(Env& env, unsigned depth) {
+        Function f{name("f"), {}, 'i', chance(o.recursion)};
+        if (f.recursive) f.depth = chance(o.deep) ? o.deep_depth : o.recursion_depth;
+        Env inner = env;
+        inner.in_function = true;
+        inner.in_loop = false;
+        inner.self = nullptr;
+        unsigned outer_calls = self_calls;
+        self_calls = 0;
+        bool closure = chance(o.closures);
+        unsigned params = pick(3) + (f.recursive ? 1 : 0);
+        vector<string> names;
+        for (unsigned i = 0; i < params; ++i) {
+            names.push_back(name("p"));
+            bool func = closure && i > 0 && chance(40) && !unary_value(env, 0).head.empty();
+            f.params.push_back(func ? 'f' : 'i');
+            if (func) inner.funcs.push_back(names.back());
+            else if (i == 0 && f.recursive) inner.counters.push_back(names.back());
+            else inner.ints.push_back(names.back());
+        }
+        if (f.recursive) inner.bound = names.front();
+        // Closure makers return a function capturing their parameters
+        bool maker = closure && !f.recursive && chance(50);
+        if (maker) f.result = 'f';
+        if (f.recursive) inner.self = &f;
+
+        vector<string> locals;
+        auto saved = declared;
+        declared = &locals;
+        vector<Node> body;
+        if (f.recursive) {
+            long b;
+            Env base = inner;
+            base.self = nullptr;
+            Node e = expr(base, 1, b);
+            body.push_back(node(Node::Command, "If", {
+                node(Node::Cond, "Lt", {leaf(Node::Expr, inner.bound), leaf(Node::Expr, "1")}),
+                node(Node::Block, "", {node(Node::Command, "Return", {capped(std::move(e), b)})}),
+                node(Node::Block, "", {})}));
+        }
+        unsigned n = pick(o.width) + 1;
+        for (unsigned i = 0; i < n; ++i) command(inner, depth, body);
+        if (maker) {
+            Env captured = inner;
+            captured.self = nullptr;
+            // The made function may also count calls in a captured variable
+            Node g = function_of_one(captured, depth);
+            string made = g.head.substr(9, g.head.find(' ', 9) - 9);
+            body.push_back(std::move(g));
+            body.push_back(node(Node::Command, "Return", {leaf(Node::Expr, made)}));
+        } else if (chance(o.unassigned)) {
+            // Returns a local assigned in one branch only
+            string u = name("u");
+            locals.push_back(u);
+            long b;
+            Node e = expr(inner, 2, b);
+            body.push_back(node(Node::Command, "If", {cond(inner, 1),
+                node(Node::Block, "", {node(Node::Command, "Assign " + u, {capped(std::move(e), b)})}),
+                node(Node::Block, "", {})}));
+            body.push_back(node(Node::Command, "Return", {leaf(Node::Expr, u)}));
+        } else {
+            long b;
+            Node e = expr(inner, 2, b);
+            body.push_back(node(Node::Command, "Return", {capped(std::move(e), b)}));
+        }
+        declared = saved;
+        self_calls = outer_calls;
+        if (!locals.empty()) body.insert(body.begin(), var(locals));
+
+        string head = "Function " + f.name + " Paras";
+        for (auto& p : names) head += " " + p;
+        env.functions.push_back(f);
+        return node(Node::Command, head, {node(Node::Block, "", std::move(body))});
+    }
+
+    // A function of one integer, defined where it can capture env
+    Node function_of_one(Env& env, unsigned depth) {
+        Env inner = env;
+        string f = name("g"), x = name("p");
+        inner.ints.push_back(x);
+        inner.in_loop = false;
+        vector<Node> body;
+        if (!env.ints.empty() && chance(o.closures)) {
+            string v = env.ints[pick(env.ints.size())];
+            body.push_back(node(Node::Command, "Assign " + v, {node(Node::Expr, "Mod", {
+                node(Node::Expr, "Plus", {leaf(Node::Expr, v), leaf(Node::Expr, x)}),
+                leaf(Node::Expr, std::to_string(cap))})}));
+        }
+        long b;
+        Node e = expr(inner, depth, b);
+        body.push_back(node(Node::Command, "Return", {capped(std::move(e), b)}));
+        env.functions.push_back(Function{f, {'i'}, 'i', false});
+        return node(Node::Command, "Function " + f + " Paras " + x, {node(Node::Block, "", std::move(body))});
+    }
+
+    Node var(const vector<string>& names) {
+        string head = "Var";
+        for (auto& n : names) head += " " + n;
+        return leaf(Node::Command, head + " End");
+    }
+
+    Node block(Env env, unsigned depth, unsigned functions = 0, unsigned reads = 0) {
+        vector<string> locals;
+        auto saved = declared;
+        declared = &locals;
+        vector<Node> body;
+
+        unsigned ints = pick(3) + (functions ? 2 : 0);
+        auto outer = env.ints;
+        for (unsigned i = 0; i < ints; ++i) {
+            // Now and then hide an outer variable
+            string v = !outer.empty() && chance(15) ? outer[pick(outer.size())] : name("v");
+            outer.erase(std::remove(outer.begin(), outer.end(), v), outer.end());
+            locals.push_back(v);
+            // Left unassigned it reads as 0 until assigned, when at all
+            if (i < reads) {
+                body.push_back(leaf(Node::Command, "Read " + v));
+            } else if (!chance(o.unassigned)) {
+                body.push_back(assign(env, v, 1));
+            }
+            env.ints.push_back(v);
+        }
+        if (!functions && depth > 0 && chance(o.closures / 2)) functions = 1;
+        for (unsigned i = 0; i < functions; ++i) {
+            body.push_back(function(env, depth));
+        }
+        if (!env.functions.empty() && chance(o.closures)) {
+            Node v = unary_value(env, 1);
+            if (!v.head.empty()) {
+                string h = name("h");
+                locals.push_back(h);
+                body.push_back(node(Node::Command, "Assign " + h, {std::move(v)}));
+                env.funcs.push_back(h);
+            }
+        }
+        unsigned n = pick(o.width) + 1;
+        for (unsigned i = 0; i < n; ++i) command(env, depth, body);
+
+        declared = saved;
+        if (!locals.empty()) body.insert(body.begin(), var(locals));
+        return node(Node::Block, "", std::move(body));
+    }
+
+    Node program() {
+        Env env;
+        Node top = block(env, o.depth, o.functions, 2);
+        // Everything left at the end
+        for (auto& son : top.sons) {
+            if (son.head.compare(0, 4, "Var ") != 0) continue;
+            std::istringstream names(son.head.substr(4));
+            string v;
+            vector<Node> prints;
+            while (names >> v && v != "End") {
+                if (v[0] == 'v') prints.push_back(node(Node::Command, "Print", {leaf(Node::Expr, v)}));
+            }
+            top.sons.insert(top.sons.end(), prints.begin(), prints.end());
+            break;
+        }
+        return top;
+    }
+
+    string input() {
+        string s;
+        for (unsigned i = 0, n = 2 + pick(4); i < n; ++i) {
+            s += std::to_string(int(pick(2001)) - 1000) + (i + 1 < n ? " " : "\n");
+        }
+        return s;
+    }
+};
+
+class Reducer {
+    string command, path;
+    unsigned tests = 0;
+
+    bool interesting(const Node& program) {
+        std::ofstream(path) << text(program);
+        ++tests;
+        return system((command + " " + path).c_str()) == 0;
+    }
+
+    void nodes(Node& n, vector<Node*>& out) {
+        out.push_back(&n);
+        for (auto& son : n.sons) nodes(son, out);
+    }
+
+    // Simpler forms of n, the smallest first
+    vector<Node> candidates(const Node& n) {
+        vector<Node> c;
+        switch (n.shape) {
+            case Node::Block:
+                for (size_t i = n.sons.size(); i-- > 0;) {
+                    Node fewer = n;
+                    fewer.sons.erase(fewer.sons.begin() + i);
+                    c.push_back(std::move(fewer));
+                    // The commands of a nested block in its place
+                    auto& son = n.sons[i];
+                    for (auto& inner : son.sons) {
+                        if (inner.shape != Node::Block || son.shape != Node::Command) continue;
+                        Node flat = n;
+                        flat.sons.erase(flat.sons.begin() + i);
+                        flat.sons.insert(flat.sons.begin() + i, inner.sons.begin(), inner.sons.end());
+                        c.push_back(std::move(flat));
+                    }
+                }
+                break;
+            case Node::Expr:
+                if (n.head != "0") c.push_back(leaf(Node::Expr, "0"));
+                if (n.head != "0" && n.head != "1") c.push_back(leaf(Node::Expr, "1"));
+                for (auto& son : n.sons) {
+                    if (son.shape == Node::Expr) c.push_back(son);
+                }
+                break;
+            case Node::Cond:
+                if (n.head != "Eq" || n.sons[0].head != "0" || n.sons[1].head != "0") {
+                    c.push_back(node(Node::Cond, "Eq", {leaf(Node::Expr, "0"), leaf(Node::Expr, "0")}));
+                }
+                if (n.head != "Lt" || n.sons[0].head != "0" || n.sons[1].head != "0") {
+                    c.push_back(node(Node::Cond, "Lt", {leaf(Node::Expr, "0"), leaf(Node::Expr, "0")}));
+                }
+                for (auto& son : n.sons) {
+                    if (son.shape == Node::Cond) c.push_back(son);
+                }
+                break;
+            default:
+                break;
+        }
+        return c;
+    }
+
+    public:
+    Reducer(const string& cmd, const string& p): command(cmd), path(p) {}
+
+    // Shrinks program while the command accepts it, false if it never did
+    bool reduce(Node& program) {
+        if (!interesting(program)) return false;
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            vector<Node*> all;
+            nodes(program, all);
+            for (size_t i = 0; i < all.size(); ++i) {
+                for (auto& c : candidates(*all[i])) {
+                    Node old = std::move(*all[i]);
+                    *all[i] = std::move(c);
+                    if (interesting(program)) {
+                        changed = true;
+                        break;
+                    }
+                    *all[i] = std::move(old);
+                }
+                // The nodes below a replaced one are gone
+                if (changed) break;
+            }
+        }
+        std::ofstream(path) << text(program);
+        cerr << "reduced in " << tests << " runs" << endl;
+        return true;
+    }
+};
+
+enum LongOption {
+    OptSeed = 256,
+    OptDepth,
+    OptWidth,
+    OptFunctions,
+    OptClosures,
+    OptRecursion,
+    OptRecursionDepth,
+    OptDeep,
+    OptDeepDepth,
+    OptTrips,
+    OptUnassigned,
+    OptReduce,
+};
+
+const option long_options[] = {
+    {"seed",      required_argument, nullptr, OptSeed},
+    {"depth",     required_argument, nullptr, OptDepth},
+    {"width",     required_argument, nullptr, OptWidth},
+    {"functions", required_argument, nullptr, OptFunctions},
+    {"closures",  required_argument, nullptr, OptClosures},
+    {"recursion", required_argument, nullptr, OptRecursion},
+    {"recursion-depth", required_argument, nullptr, OptRecursionDepth},
+    {"deep",      required_argument, nullptr, OptDeep},
+    {"deep-depth", required_argument, nullptr, OptDeepDepth},
+    {"trips",     required_argument, nullptr, OptTrips},
+    {"unassigned", required_argument, nullptr, OptUnassigned},
+    {"reduce",    required_argument, nullptr, OptReduce},
+    {nullptr,     0,                 nullptr, 0},
+};
+
+}
+
+int main(int argc, char *argv[]) {
+    Options o;
+    const char *prog = nullptr, *infile = nullptr, *reduce = nullptr;
+    int c;
+    while ((c = getopt_long(argc, argv, "hi:p:", long_options, nullptr)) != -1) {
+        switch (c) {
+            case 'i':
+                infile = optarg;
+                break;
+            case 'p':
+                prog = optarg;
+                break;
+            case OptSeed:
+                o.seed = std::strtoul(optarg, nullptr, 10);
+                break;
+            case OptDepth:
+                o.depth = std::atoi(optarg);
+                break;
+            case OptWidth:
+                o.width = std::max(1, std::atoi(optarg));
+                break;
+            case OptFunctions:
+                o.functions = std::atoi(optarg);
+                break;
+            case OptClosures:
+                o.closures = std::atoi(optarg);
+                break;
+            case OptRecursion:
+                o.recursion = std::atoi(optarg);
+                break;
+            case OptRecursionDepth:
+                o.recursion_depth = std::atoi(optarg);
+                break;
+            case OptDeep:
+                o.deep = std::atoi(optarg);
+                break;
+            case OptDeepDepth:
+                o.deep_depth = std::atoi(optarg);
+                break;
+            case OptTrips:
+                o.trips = std::atoi(optarg);
+                break;
+            case OptUnassigned:
+                o.unassigned = std::atoi(optarg);
+                break;
+            case OptReduce:
+                reduce = optarg;
+                break;
+            case 'h':
+                std::cout << "Usage: -p <program.txt> -i <input.txt> [--seed N] [--depth N] [--width N] [--functions N]" << endl;
+                std::cout << "       [--closures PERCENT] [--recursion PERCENT] [--recursion-depth N] [--trips N]" << endl;
+                std::cout << "       [--deep PERCENT] [--deep-depth N] [--unassigned PERCENT] [--reduce <command>]" << endl;
+                return 0;
+            default:
+                return 1;
+        }
+    }
+    if (!prog || !infile) {
+        cerr << "ERROR: Expect -p <program.txt> -i <input.txt>" << endl;
+        return 1;
+    }
+
+    Generator g(o);
+    Node program = g.program();
+    std::ofstream(infile) << g.input();
+    if (reduce) {
+        Reducer r(reduce, prog);
+        if (!r.reduce(program)) {
+            cerr << "ERROR: The command does not accept the program" << endl;
+            return 1;
+        }
+        return 0;
+    }
+    std::ofstream out(prog);
+    out << text(program);
+    return out ? 0 : 1;
+}
@@ -1,19 +1,169 @@
 #include <iostream>
+#include <cstring>
+#include <csignal>
+#include <functional>
+#include <thread>
 #include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/resource.h>
 
 #include "zitp.hpp"
+#include "server.hpp"
+#include "multiplex.hpp"
+#include "spmd.hpp"
 
 using std::cout;
+using std::cerr;
 using std::endl;
 using std::ifstream;
 
+enum LongOption {
+    OptServe = 256,
+    OptConnect,
+    OptWorkers,
+    OptQueue,
+    OptCache,
+    OptMaxRequest,
+    OptMultiplex,
+    OptSpmd,
+    OptEngine,
+    OptStats,
+    OptLazy,
+    OptStream,
+    OptSnapshot,
+    OptRestore,
+    OptRecordProfile,
+    OptUseProfile,
+    OptParallel,
+    OptHeapCensus,
+    OptFuel,
+    OptMaxDepth,
+    OptMaxMemory,
+    OptParseThreads,
+    OptDumpAst,
+};
+
+static const option long_options[] = {
+    {"serve",   required_argument, nullptr, OptServe},
+    {"connect", required_argument, nullptr, OptConnect},
+    {"workers", required_argument, nullptr, OptWorkers},
+    {"queue",   required_argument, nullptr, OptQueue},
+    {"cache",   required_argument, nullptr, OptCache},
+    {"max-request", required_argument, nullptr, OptMaxRequest},
+    {"multiplex", no_argument,     nullptr, OptMultiplex},
+    {"spmd",    no_argument,       nullptr, OptSpmd},
+    {"engine",  required_argument, nullptr, OptEngine},
+    {"stats",   no_argument,       nullptr, OptStats},
+    {"lazy",    no_argument,       nullptr, OptLazy},
+    {"stream",  no_argument,       nullptr, OptStream},
+    {"snapshot-after-init", required_argument, nullptr, OptSnapshot},
+    {"restore", required_argument, nullptr, OptRestore},
+    {"record-profile", required_argument, nullptr, OptRecordProfile},
+    {"use-profile", required_argument, nullptr, OptUseProfile},
+    {"parallel", required_argument, nullptr, OptParallel},
+    {"heap-census", required_argument, nullptr, OptHeapCensus},
+    {"fuel",    required_argument, nullptr, OptFuel},
+    {"max-depth", required_argument, nullptr, OptMaxDepth},
+    {"max-memory", required_argument, nullptr, OptMaxMemory},
+    {"parse-threads", required_argument, nullptr, OptParseThreads},
+    {"dump-ast", required_argument, nullptr, OptDumpAst},
+    {nullptr,   0,                 nullptr, 0},
+};
+
+static bool split_pair(const std::string& spec, std::string& in, std::string& out) {
+    auto colon = spec.rfind(':');
+    if (colon == std::string::npos) {
+        cerr << "ERROR: Expect <input>:<output>, got " << spec << endl;
+        return false;
+    }
+    in = spec.substr(0, colon);
+    out = spec.substr(colon + 1);
+    return true;
+}
+
+static void* call(void *f) {
+    return (void *)(intptr_t)(*static_cast<const std::function<int()>*>(f))();
+}
+
+// Runs f on a thread with a stack of size bytes, returns what it returns or
+// -1 when no such thread can be made
+static int on_stack(usize size, const std::function<int()>& f) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_t t;
+    void *code = (void *)(intptr_t)-1;
+    if (pthread_attr_setstacksize(&attr, size) == 0 &&
+        pthread_create(&t, &attr, call, (void *)&f) == 0) {
+        pthread_join(t, &code);
+    }
+    pthread_attr_destroy(&attr);
+    return (int)(intptr_t)code;
+}
+
+// Every argument is an <input>:<output> pair fed to its own instance
+static int run_multiplexed(Term *ast, Engine engine, const Budget& budget, int n, char *specs[]) {
+    if (!ast) return 1;
+    Multiplexer m(ast);
+    m.set_engine(engine);
+    m.set_budget(budget);
+    for (int i = 0; i < n; ++i) {
+        std::string in, out;
+        if (!split_pair(specs[i], in, out)) return 1;
+        int ifd = open(in.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        int ofd = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (ifd < 0 || ofd < 0) {
+            cerr << "ERROR: Failed to open " << (ifd < 0 ? in : out) << endl;
+            return 1;
+        }
+        m.add(ifd, ofd);
+    }
+    return m.run() ? 1 : 0;
+}
+
+// Same pairs, run in lockstep
+static int run_spmd(Term *ast, Engine engine, int n, char *specs[], bool stats) {
+    if (!ast) return 1;
+    Spmd s(ast);
+    s.set_engine(engine);
+    for (int i = 0; i < n; ++i) {
+        std::string in, out;
+        if (!split_pair(specs[i], in, out)) return 1;
+        s.add(in, out);
+    }
+    int failed = s.run();
+    if (stats) {
+        cerr << "spmd: " << (s.vectorized() ? "vectorized" : "scalar")
+             << ", in lanes " << s.in_lanes << ", dropped " << s.dropped << endl;
+    }
+    return failed ? 1 : 0;
+}
+
 int main(int argc, char *argv[]) {
     char *infile(nullptr),
          *outfile(nullptr),
-         *prog(nullptr);
+         *prog(nullptr),
+         *serve(nullptr),
+         *remote(nullptr),
+         *snapshot(nullptr),
+         *restore(nullptr),
+         *record_profile(nullptr),
+         *use_profile(nullptr),
+         *census(nullptr),
+         *dump(nullptr);
+    unsigned workers = std::thread::hardware_concurrency();
+    usize queue = 64, cache = 256, max_request = Server::default_max_request;
+    bool multiplex = false, spmd = false;
+    bool stats = false;
+    bool lazy = false;
+    bool stream = false;
+    unsigned threads = 0, parse_threads = 0;
+    Budget budget;
+    Engine engine = QuickEngine;
 
     int c;
-    while ((c = getopt(argc, argv, "hi:o:p:")) != -1) {
+    while ((c = getopt_long(argc, argv, "hi:o:p:", long_options, nullptr)) != -1) {
         switch (c) {
             case 'i':
                 infile = optarg;
@@ -24,22 +174,209 @@ int main(int argc, char *argv[]) {
             case 'p':
                 prog = optarg;
                 break;
+            case OptServe:
+                serve = optarg;
+                break;
+            case OptConnect:
+                remote = optarg;
+                break;
+            case OptWorkers:
+                workers = std::atoi(optarg);
+                break;
+            case OptQueue:
+                queue = std::atoi(optarg);
+                break;
+            case OptCache:
+                cache = std::atoi(optarg);
+                break;
+            case OptMaxRequest:
+                max_request = std::strtoull(optarg, nullptr, 10);
+                break;
+            case OptMultiplex:
+                multiplex = true;
+                break;
+            case OptSpmd:
+                // Restricted like --multiplex, it is another way to run the pairs
+                multiplex = spmd = true;
+                break;
+            case OptStats:
+                stats = true;
+                break;
+            case OptLazy:
+                lazy = true;
+                break;
+            case OptStream:
+                stream = true;
+                break;
+            case OptSnapshot:
+                snapshot = optarg;
+                break;
+            case OptRestore:
+                restore = optarg;
+                break;
+            case OptRecordProfile:
+                record_profile = optarg;
+                break;
+            case OptUseProfile:
+                use_profile = optarg;
+                break;
+            case OptParallel:
+                threads = std::atoi(optarg);
+                break;
+            case OptHeapCensus:
+                census = optarg;
+                break;
+            case OptFuel:
+                budget.fuel = std::strtoull(optarg, nullptr, 10);
+                break;
+            case OptMaxDepth:
+                budget.depth = std::atoi(optarg);
+                break;
+            case OptMaxMemory:
+                budget.memory = std::strtoull(optarg, nullptr, 10);
+                break;
+            case OptParseThreads:
+                parse_threads = std::atoi(optarg);
+                break;
+            case OptDumpAst:
+                dump = optarg;
+                break;
+            case OptEngine:
+                if (!strcmp(optarg, "tree")) engine = TreeEngine;
+                else if (!strcmp(optarg, "quick")) engine = QuickEngine;
+                else if (!strcmp(optarg, "closure")) engine = ClosureEngine;
+                else {
+                    cerr << "ERROR: Unknown engine " << optarg << endl;
+                    return 1;
+                }
+                break;
             case 'h':
-                cout << "Usage: -i <input.txt> -o <output.txt> -p <program.txt>" << endl;
+                cout << "Usage: -i <input.txt> -o <output.txt> -p <program.txt> [--engine tree|quick|closure] [--stats] [--lazy|--stream|--parse-threads N]" << endl;
+                cout << "       [--dump-ast <file>]" << endl;
+                cout << "       [--snapshot-after-init <file> | --restore <file>]" << endl;
+                cout << "       [--record-profile <file>] [--use-profile <file>] [--parallel N]" << endl;
+                cout << "       [--heap-census <file>] [--fuel N] [--max-depth N] [--max-memory BYTES]" << endl;
+                cout << "       --serve <path.sock> [--workers N] [--queue N] [--cache N] [--max-request BYTES] [--fuel N] [--max-depth N] [--max-memory BYTES]" << endl;
+                cout << "       --connect <path.sock> -i <input.txt> -o <output.txt> -p <program.txt>" << endl;
+                cout << "       --multiplex|--spmd -p <program.txt> <input>:<output>..." << endl;
                 return 0;
             default:
                 return 1;
         }
     }
 
-    ifstream input(prog ? prog : "program.txt");
+    if (serve) {
+        Server server(serve, workers, queue, cache);
+        server.set_budget(budget);
+        server.set_max_request(max_request);
+        return server.serve();
+    }
+    if (remote) {
+        return run_remote(remote, prog, infile, outfile);
+    }
+
+    if ((stream || snapshot || restore) && (lazy || multiplex)) {
+        cerr << "ERROR: --stream and snapshots need a single eagerly parsed instance" << endl;
+        return 1;
+    }
+    if (stream && (snapshot || restore)) {
+        cerr << "ERROR: --stream cannot take or restore snapshots" << endl;
+        return 1;
+    }
+
+    if ((record_profile || use_profile) && (lazy || stream || multiplex)) {
+        cerr << "ERROR: Profiles need a single eagerly parsed instance" << endl;
+        return 1;
+    }
+
+    if ((budget.fuel || budget.depth || budget.memory) && spmd) {
+        cerr << "ERROR: --spmd runs without budgets" << endl;
+        return 1;
+    }
+    if (budget.memory && multiplex) {
+        cerr << "ERROR: --max-memory needs a single instance" << endl;
+        return 1;
+    }
+
+    if (parse_threads > 1 && (lazy || stream)) {
+        cerr << "ERROR: --parse-threads parses the whole program before running" << endl;
+        return 1;
+    }
+
+    if (threads && (stream || multiplex)) {
+        cerr << "ERROR: --parallel needs a single parsed program" << endl;
+        return 1;
+    }
+
     Zitp *z = new Zitp(prog, infile, outfile);
-    z->parse_ast();
-    #if DEBUG_MODE
-    z->ast->print();
-    #endif
-    z->run();
-	cout << "Program exited." << endl;
-    return 0;
+    z->set_lazy(lazy);
+    z->set_parse_threads(parse_threads);
+    z->set_engine(engine);
+    if (snapshot) z->snapshot_after_init(snapshot);
+    if (restore) z->restore_from(restore);
+    if (record_profile) z->record_profile(record_profile);
+    if (use_profile) z->use_profile(use_profile);
+    z->set_parallel(threads);
+    z->set_budget(budget);
+    if (census) {
+        if (multiplex) {
+            cerr << "ERROR: --heap-census needs a single instance" << endl;
+            return 1;
+        }
+        if (!z->heap_census_to(census)) {
+            cerr << "ERROR: Failed to open " << census << endl;
+            return 1;
+        }
+        signal(SIGUSR1, request_census);
+    }
+    auto run = [&]() -> int {
+        try {
+            if (stream) {
+                z->run_stream();
+            } else {
+                z->parse_ast();
+                if (spmd) {
+                    return run_spmd(z->ast, engine, argc - optind, argv + optind, stats);
+                }
+                if (multiplex) {
+                    return run_multiplexed(z->ast, engine, budget, argc - optind, argv + optind);
+                }
+                #if DEBUG_MODE
+                if (z->ast) z->ast->print();
+                #endif
+                if (dump && z->ast) {
+                    std::ofstream ofs(dump);
+                    z->ast->print(ofs);
+                }
+                z->run();
+            }
+            if (stats) z->fusion_stats().print(cerr);
+        } catch (const LimitError& e) {
+            cerr << "ERROR: " << e.what() << endl;
+            z->heap_census("exit");
+            return e.exit_code();
+        } catch (const RuntimeError& e) {
+            cerr << "ERROR: " << e.what() << endl;
+            z->heap_census("exit");
+            return 1;
+        }
+        // Everything the run made is gone by now, what is left leaked
+        z->heap_census("exit");
+        cout << "Program exited." << endl;
+        return 0;
+    };
+    // The main stack may not hold as many calls as --max-depth lets nest,
+    // multiplexed instances have stacks of their own
+    usize stack = budget.depth && !multiplex ? Zitp::stack_for(budget.depth) : 0;
+    rlimit limit;
+    if (stack && getrlimit(RLIMIT_STACK, &limit) == 0 &&
+        limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < stack) {
+        int code = on_stack(stack, run);
+        if (code < 0) {
+            cerr << "ERROR: Cannot allocate a stack for --max-depth " << budget.depth << endl;
+            return 1;
+        }
+        return code;
+    }
+    return run();
 }
-
@@ -0,0 +1,253 @@
+#include <cstring>
+#include <streambuf>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "multiplex.hpp"
+#include "zitp.hpp"
+
+using std::cerr;
+using std::endl;
+using std::string;
+
+// Reads the input descriptor, yielding to the event loop when it would block
+class InputBuf : public std::streambuf {
+    Multiplexer::Instance *inst;
+    char buf[4096];
+
+    protected:
+    int_type underflow() override;
+
+    public:
+    InputBuf(Multiplexer::Instance *i): inst(i) {}
+};
+
+// Collects output until the event loop can write it out
+class OutputBuf : public std::streambuf {
+    protected:
+    int_type overflow(int_type c) override {
+        if (c != traits_type::eof()) pending.push_back((char)c);
+        return c;
+    }
+    std::streamsize xsputn(const char *s, std::streamsize n) override {
+        pending.append(s, n);
+        return n;
+    }
+
+    public:
+    string pending;
+};
+
+struct Multiplexer::Instance {
+    Multiplexer *owner;
+    usize index;
+    int in_fd, out_fd;
+    bool in_pollable, out_pollable;
+    u32 in_mask = 0, out_mask = 0;
+    bool waiting = false;
+    bool done = false;
+    bool failed = false;
+    ucontext_t ctx;
+    char *stack = nullptr;
+    InputBuf inbuf;
+    OutputBuf outbuf;
+    std::istream in;
+    std::ostream out;
+
+    Instance(Multiplexer *m, usize i, int ifd, int ofd):
+        owner(m), index(i), in_fd(ifd), out_fd(ofd),
+        inbuf(this), in(&inbuf), out(&outbuf) {}
+};
+
+InputBuf::int_type InputBuf::underflow() {
+    for (;;) {
+        ssize_t n = ::read(inst->in_fd, buf, sizeof(buf));
+        if (n > 0) {
+            setg(buf, buf, buf + n);
+            return traits_type::to_int_type(buf[0]);
+        }
+        if (n == 0) return traits_type::eof();
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return traits_type::eof();
+        // Suspend until epoll reports the descriptor readable
+        inst->waiting = true;
+        swapcontext(&inst->ctx, &inst->owner->loop);
+        inst->waiting = false;
+    }
+}
+
+static bool pollable(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || S_ISREG(st.st_mode)) return false;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return true;
+}
+
+static void watch(int epfd, int fd, u32& mask, u32 want, usize index) {
+    if (mask == want) return;
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = want;
+    ev.data.u64 = index;
+    int op = !mask ? EPOLL_CTL_ADD : !want ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    epoll_ctl(epfd, op, fd, &ev);
+    mask = want;
+}
+
+Multiplexer::Multiplexer(Term *t):
+    ast(t), epfd(epoll_create1(EPOLL_CLOEXEC))
+{
+    set_budget(Budget());
+}
+
+Multiplexer::~Multiplexer() {
+    for (auto& inst : instances) {
+        if (!inst->done) finish(inst.get());
+    }
+    close(epfd);
+}
+
+void Multiplexer::set_budget(const Budget& b) {
+    budget = b;
+    if (!budget.depth) budget.depth = default_depth;
+    // Bytes in use are counted per thread, not per instance
+    budget.memory = 0;
+    // Only touched pages are backed, most of a deep stack never is
+    stack_size = Zitp::stack_for(budget.depth);
+}
+
+void Multiplexer::add(int in_fd, int out_fd) {
+    auto inst = new Instance(this, instances.size(), in_fd, out_fd);
+    inst->in_pollable = pollable(in_fd);
+    inst->out_pollable = pollable(out_fd);
+    instances.emplace_back(inst);
+}
+
+void Multiplexer::entry(int hi, int lo) {
+    auto inst = (Instance *)(((uintptr_t)(u32)hi << 32) | (uintptr_t)(u32)lo);
+    try {
+        Zitp z(inst->owner->ast, inst->in, inst->out);
+        z.set_engine(inst->owner->engine);
+        z.set_budget(inst->owner->budget);
+        z.run();
+    } catch (const RuntimeError& e) {
+        cerr << "ERROR: instance " << inst->index << ": " << e.what() << endl;
+        inst->failed = true;
+    }
+    inst->done = true;
+    // Returning switches to uc_link, the event loop
+}
+
+void Multiplexer::start(Instance *inst) {
+    // One extra page below the stack stays unmapped to catch overflows
+    usize page = sysconf(_SC_PAGESIZE);
+    void *mem = mmap(nullptr, stack_size + page, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (mem == MAP_FAILED) {
+        cerr << "ERROR: instance " << inst->index << ": cannot allocate stack" << endl;
+        inst->failed = true;
+        return finish(inst);
+    }
+    mprotect(mem, page, PROT_NONE);
+    inst->stack = (char *)mem;
+
+    getcontext(&inst->ctx);
+    inst->ctx.uc_stack.ss_sp = inst->stack + page;
+    inst->ctx.uc_stack.ss_size = stack_size;
+    inst->ctx.uc_link = &loop;
+    uintptr_t p = (uintptr_t)inst;
+    makecontext(&inst->ctx, (void (*)())entry, 2, (int)(u32)(p >> 32), (int)(u32)p);
+    resume(inst);
+}
+
+void Multiplexer::resume(Instance *inst) {
+    swapcontext(&loop, &inst->ctx);
+    flush(inst);
+}
+
+void Multiplexer::flush(Instance *inst) {
+    string& pending = inst->outbuf.pending;
+    usize done = 0;
+    while (done < pending.size()) {
+        ssize_t n = ::write(inst->out_fd, pending.data() + done, pending.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) {
+            // The reader went away, drop what is left
+            done = pending.size();
+            break;
+        }
+        done += n;
+    }
+    pending.erase(0, done);
+
+    if (inst->done && pending.empty()) {
+        return finish(inst);
+    }
+
+    u32 want_in = inst->in_pollable && !inst->done ? EPOLLIN : 0;
+    u32 want_out = inst->out_pollable && !pending.empty() ? EPOLLOUT : 0;
+    if (inst->in_fd == inst->out_fd) {
+        watch(epfd, inst->in_fd, inst->in_mask, want_in | want_out, inst->index);
+    } else {
+        watch(epfd, inst->in_fd, inst->in_mask, want_in, inst->index);
+        watch(epfd, inst->out_fd, inst->out_mask, want_out, inst->index);
+    }
+}
+
+void Multiplexer::finish(Instance *inst) {
+    watch(epfd, inst->in_fd, inst->in_mask, 0, inst->index);
+    if (inst->out_fd != inst->in_fd) {
+        watch(epfd, inst->out_fd, inst->out_mask, 0, inst->index);
+        close(inst->out_fd);
+    }
+    close(inst->in_fd);
+    if (inst->stack) {
+        munmap(inst->stack, stack_size + sysconf(_SC_PAGESIZE));
+        inst->stack = nullptr;
+    }
+    inst->done = true;
+    inst->in_fd = inst->out_fd = -1;
+}
+
+int Multiplexer::run() {
+    for (auto& inst : instances) {
+        start(inst.get());
+    }
+
+    usize live = 0;
+    for (auto& inst : instances) {
+        if (inst->in_fd >= 0) ++live;
+    }
+
+    epoll_event events[64];
+    while (live > 0) {
+        int n = epoll_wait(epfd, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            Instance *inst = instances[events[i].data.u64].get();
+            if (inst->in_fd < 0) continue;
+            if (events[i].events & EPOLLOUT) {
+                flush(inst);
+            }
+            if (inst->waiting && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                resume(inst);
+            }
+            if (inst->in_fd < 0) --live;
+        }
+    }
+
+    int failed = 0;
+    for (auto& inst : instances) {
+        if (inst->failed) ++failed;
+    }
+    return failed;
+}
@@ -0,0 +1,68 @@
+#ifndef ZITP_MULTIPLEX_H
+#define ZITP_MULTIPLEX_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <ucontext.h>
+
+#include "Term.hpp"
+#include "value.hpp"
+#include "zitp.hpp"
+
+/*
+ * Runs many instances of one program on a single thread.
+ *
+ * Every instance executes on its own heap-allocated stack. When Read finds
+ * no buffered input the instance swaps back to the event loop instead of
+ * blocking, and epoll resumes it once its input descriptor is readable.
+ * Output is buffered per instance and drained whenever the descriptor
+ * accepts more, so a slow reader never stalls the other instances. Stacks
+ * are sized for the call depth an instance may reach, one recursing past
+ * it fails alone instead of overflowing its stack.
+ */
+class Multiplexer {
+    public:
+    struct Instance;
+
+    // Instances nest at most this many calls unless their budget says
+    // otherwise
+    static const u32 default_depth = 10000;
+
+    Multiplexer(Term *ast);
+    ~Multiplexer();
+
+    // Takes ownership of both descriptors, which may be pipes, sockets,
+    // FIFOs or regular files.
+    void add(int in_fd, int out_fd);
+
+    // Instances share one thread, so any engine may be used
+    void set_engine(Engine e) { engine = e; }
+
+    // Limits every instance on its own, but for memory; stacks hold
+    // b.depth calls, or default_depth without a depth limit
+    void set_budget(const Budget& b);
+
+    // Runs every instance to completion, returns how many of them failed
+    int run();
+
+    private:
+    Term *ast;
+    usize stack_size;
+    Budget budget;
+    Engine engine = QuickEngine;
+    int epfd;
+    ucontext_t loop;
+    std::vector<std::unique_ptr<Instance>> instances;
+
+    static void entry(int hi, int lo);
+    void start(Instance *inst);
+    void resume(Instance *inst);
+    void flush(Instance *inst);
+    void finish(Instance *inst);
+
+    friend class InputBuf;
+};
+
+#endif
@@ -0,0 +1,342 @@
+#include <alloca.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "parallel.hpp"
+#include "profile.hpp"
+
+namespace {
+
+// Index of the deque the running thread pushes to, the main thread uses 0
+thread_local unsigned me = 0;
+
+void functions_of(Term *t, std::vector<Term*>& out) {
+    if (t->kind == Function) out.push_back(t);
+    for (auto son : t->sons) functions_of(son, out);
+}
+
+bool recurses(const Parallel::Node *n) {
+    if (n->kind == Expr && n->op == Apply) return true;
+    for (auto son : n->sons) {
+        if (recurses(son)) return true;
+    }
+    return false;
+}
+
+// Operands evaluated one after the other no matter what they yield
+bool strict(const Parallel::Node *n) {
+    if (n->kind == Expr) return n->op == Apply || (n->op >= Plus && n->op <= Mod);
+    return n->kind == BoolExpr && n->op >= Lt && n->op <= Eq;
+}
+
+}
+
+Parallel::Parallel(Term *ast, unsigned threads) {
+    std::vector<Term*> funcs;
+    functions_of(ast, funcs);
+    for (auto func : funcs) {
+        if (func->sons.back()->lazy || !pure_function(func, ast)) continue;
+        std::unordered_map<Term*, i32> slots;
+        auto last = --func->sons.end();
+        bool typed = true;
+        usize params = 0;
+        for (auto it = ++func->sons.begin(); it != last; ++it, ++params) {
+            typed = typed && (*it)->decl->type == IntType;
+            // A repeated name is one variable, holding its last argument. The
+            // repeat keeps a slot of its own so locals come after every argument.
+            slots[(*it)->decl] = params;
+            if ((*it)->decl != *it) slots.emplace(*it, params);
+        }
+        auto body = typed ? compile(*last, func, slots) : nullptr;
+        if (body) functions[func] = Pure{body, params, slots.size()};
+    }
+    // Calls are resolved once every function is compiled
+    for (auto& n : nodes) {
+        auto f = functions.find(n.target);
+        if (f != functions.end()) n.callee = &f->second;
+        n.fork = n.sons.size() > 1 && strict(&n) &&
+                 std::count_if(n.sons.begin(), n.sons.end(), recurses) > 1;
+    }
+
+    for (unsigned i = 0; i < std::max(threads, 1u); ++i) {
+        queues.emplace_back(new Queue);
+    }
+    for (unsigned i = 1; i < threads; ++i) {
+        workers.emplace_back(&Parallel::work, this, i);
+    }
+}
+
+Parallel::~Parallel() {
+    stopping = true;
+    wake.notify_all();
+    for (auto& w : workers) w.join();
+}
+
+// Nullptr when t uses anything the evaluator does not handle
+const Parallel::Node* Parallel::compile(Term *t, Term *func, std::unordered_map<Term*, i32>& slots) {
+    nodes.emplace_back();
+    Node& n = nodes.back();
+    n.kind = t->kind;
+    n.op = t->subtype;
+    auto add = [&](Term *son) {
+        auto c = compile(son, func, slots);
+        n.sons.push_back(c);
+        return c != nullptr;
+    };
+    auto slot = [&](Term *name) {
+        auto it = slots.find(name->decl);
+        return it == slots.end() ? -1 : it->second;
+    };
+    switch (t->kind) {
+        case Block:
+            for (auto son : t->sons) {
+                if (!add(son)) return nullptr;
+            }
+            return &n;
+        case Command:
+            switch (t->subtype) {
+                case Declaration:
+                    for (auto var : t->sons) {
+                        if (slots.count(var->decl)) continue;
+                        slots.emplace(var->decl, slots.size());
+                        n.fresh.push_back(slots[var->decl]);
+                    }
+                    return &n;
+                case Assign:
+                    n.value = slot(t->sons.front());
+                    if (n.value < 0 || t->sons.back()->type != IntType) return nullptr;
+                    return add(t->sons.back()) ? &n : nullptr;
+                case Return:
+                    if (t->sons.front()->type != IntType) return nullptr;
+                    n.value = t->sons.front()->subtype == VarName ? slot(t->sons.front()) : -1;
+                    return add(t->sons.front()) ? &n : nullptr;
+                case If:
+                case While:
+                    for (auto son : t->sons) {
+                        if (!add(son)) return nullptr;
+                    }
+                    return &n;
+                default:
+                    return nullptr;
+            }
+        case BoolExpr:
+            for (auto son : t->sons) {
+                if (!add(son)) return nullptr;
+            }
+            return &n;
+        case Expr:
+            switch (t->subtype) {
+                case Number:
+                    n.value = t->number;
+                    return &n;
+                case VarName:
+                    n.value = slot(t);
+                    return n.value < 0 || t->type != IntType ? nullptr : &n;
+                case Apply: {
+                    Term *name = t->sons.front();
+                    if (name->decl != func->sons.front()->decl ||
+                        t->sons.size() != func->sons.size() - 1) {
+                        return nullptr;
+                    }
+                    for (auto it = ++t->sons.begin(); it != t->sons.end(); ++it) {
+                        if ((*it)->type != IntType || !add(*it)) return nullptr;
+                    }
+                    n.target = func;
+                    return &n;
+                }
+                default:
+                    for (auto son : t->sons) {
+                        if (!add(son)) return nullptr;
+                    }
+                    return &n;
+            }
+        default:
+            return nullptr;
+    }
+}
+
+i32 Parallel::call(const Pure *f, const i32 *args, unsigned depth) {
+    auto vars = static_cast<i32*>(alloca(f->slots * sizeof(i32)));
+    auto set = static_cast<bool*>(alloca(f->slots));
+    memcpy(vars, args, f->params * sizeof(i32));
+    memset(vars + f->params, 0, (f->slots - f->params) * sizeof(i32));
+    memset(set, true, f->params);
+    memset(set + f->params, false, f->slots - f->params);
+    i32 result = 0;
+    exec(f->body, vars, set, result, depth);
+    return result;
+}
+
+bool Parallel::exec(const Node *block, i32 *vars, bool *set, i32& result, unsigned depth) {
+    for (auto st : block->sons) {
+        switch (st->op) {
+            case Declaration:
+                for (auto s : st->fresh) vars[s] = 0, set[s] = false;
+                break;
+            case Assign:
+                vars[st->value] = eval(st->sons.front(), vars, depth);
+                set[st->value] = true;
+                break;
+            case Return:
+                result = eval(st->sons.front(), vars, depth);
+                // Reading an unassigned variable gives 0, returning it fails
+                if (st->value >= 0 && !set[st->value]) {
+                    throw RuntimeError("Return unexpected value");
+                }
+                return true;
+            case If:
+                if (exec(st->sons[test(st->sons[0], vars, depth) ? 1 : 2], vars, set, result, depth)) {
+                    return true;
+                }
+                break;
+            case While:
+                while (test(st->sons[0], vars, depth)) {
+                    if (exec(st->sons[1], vars, set, result, depth)) return true;
+                }
+                break;
+        }
+    }
+    return false;
+}
+
+i32 Parallel::eval(const Node *n, const i32 *vars, unsigned depth) {
+    switch (n->op) {
+        case Number:
+            return n->value;
+        case VarName:
+            return vars[n->value];
+        case Apply: {
+            auto args = static_cast<i32*>(alloca(n->sons.size() * sizeof(i32)));
+            operands(n, vars, depth, args);
+            return call(n->callee, args, depth);
+        }
+    }
+    i32 v[2];
+    operands(n, vars, depth, v);
+    switch (n->op) {
+        case Plus:
+            return v[0] + v[1];
+        case Minus:
+            return v[0] - v[1];
+        case Mult:
+            return v[0] * v[1];
+        default:
+            if (v[1] == 0) {
+                throw RuntimeError("integer division or modulo by zero");
+            }
+            return n->op == Div ? v[0] / v[1] : v[0] % v[1];
+    }
+}
+
+bool Parallel::test(const Node *n, const i32 *vars, unsigned depth) {
+    switch (n->op) {
+        case And:
+            return test(n->sons[0], vars, depth) && test(n->sons[1], vars, depth);
+        case Or:
+            return test(n->sons[0], vars, depth) || test(n->sons[1], vars, depth);
+        case Negb:
+            return !test(n->sons[0], vars, depth);
+    }
+    i32 v[2];
+    operands(n, vars, depth, v);
+    switch (n->op) {
+        case Lt:
+            return v[0] < v[1];
+        case Gt:
+            return v[0] > v[1];
+        default:
+            return v[0] == v[1];
+    }
+}
+
+void Parallel::operands(const Node *n, const i32 *vars, unsigned depth, i32 *out) {
+    usize k = n->sons.size();
+    if (!n->fork || workers.empty() || depth >= fork_depth) {
+        for (usize i = 0; i < k; ++i) out[i] = eval(n->sons[i], vars, depth);
+        return;
+    }
+    std::vector<Task> tasks(k - 1);
+    for (usize i = 0; i + 1 < k; ++i) {
+        tasks[i].expr = n->sons[i];
+        tasks[i].vars = vars;
+        tasks[i].depth = depth + 1;
+        spawn(&tasks[i]);
+    }
+    std::exception_ptr error;
+    try {
+        out[k - 1] = eval(n->sons[k - 1], vars, depth + 1);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    // Every task reads vars, none may outlive this frame
+    for (auto& t : tasks) wait(&t);
+    for (usize i = 0; i + 1 < k; ++i) {
+        if (tasks[i].error) std::rethrow_exception(tasks[i].error);
+        out[i] = tasks[i].value;
+    }
+    if (error) std::rethrow_exception(error);
+}
+
+void Parallel::spawn(Task *t) {
+    auto& q = *queues[me];
+    {
+        std::lock_guard<std::mutex> guard(q.lock);
+        q.tasks.push_back(t);
+    }
+    if (sleeping) wake.notify_one();
+}
+
+// The newest task of our own deque, else the oldest of another one
+Parallel::Task* Parallel::next() {
+    unsigned n = queues.size();
+    for (unsigned i = 0; i < n; ++i) {
+        auto& q = *queues[(me + i) % n];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (q.tasks.empty()) continue;
+        Task *t;
+        if (i == 0) {
+            t = q.tasks.back();
+            q.tasks.pop_back();
+        } else {
+            t = q.tasks.front();
+            q.tasks.pop_front();
+        }
+        return t;
+    }
+    return nullptr;
+}
+
+void Parallel::run(Task *t) {
+    try {
+        t->value = eval(t->expr, t->vars, t->depth);
+    } catch (...) {
+        t->error = std::current_exception();
+    }
+    t->done.store(true, std::memory_order_release);
+}
+
+void Parallel::wait(Task *t) {
+    while (!t->done.load(std::memory_order_acquire)) {
+        if (auto other = next()) {
+            run(other);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void Parallel::work(unsigned index) {
+    me = index;
+    while (!stopping) {
+        if (auto t = next()) {
+            run(t);
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(sleep_lock);
+        ++sleeping;
+        // Bounded, a push may race with going to sleep
+        wake.wait_for(guard, std::chrono::milliseconds(1));
+        --sleeping;
+    }
+}
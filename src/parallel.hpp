@@ -0,0 +1,108 @@
+#ifndef ZITP_PARALLEL_H
+#define ZITP_PARALLEL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Term.hpp"
+#include "value.hpp"
+#include "profile.hpp"
+
+/*
+ * Parallel evaluation of pure integer functions, see --parallel.
+ *
+ * A function qualifies when pure_function() holds, its parameters, the
+ * variables it reads and its result are typed Int and it calls nothing but
+ * itself. Its calls only ever see integers of their own, so they are run
+ * by a separate evaluator keeping variables in plain arrays, which never
+ * touches a Value, a Scope or the quickening state of the tree.
+ *
+ * Where two or more operands of a strict operator, or arguments of a call,
+ * contain a recursive call, all but the last are pushed as tasks on the
+ * deque of the running thread and the last is evaluated in place. Idle
+ * threads steal the oldest task of another deque, a thread waiting for its
+ * task runs other tasks meanwhile. Results and errors are taken in program
+ * order, so a run prints what a sequential run prints. Forking stops
+ * `fork_depth` forks down, below that calls run sequentially.
+ */
+class Parallel {
+    public:
+    struct Pure;
+    struct Node {
+        TermKind kind;
+        TermSubtype op;
+        i32 value = 0;                  // Number: the constant, names, Return
+                                        // of a variable: the slot, else -1
+        bool fork = false;              // Evaluate the sons as parallel tasks
+        std::vector<const Node*> sons;
+        std::vector<i32> fresh;         // Declaration: slots it unassigns
+        Term *target = nullptr;         // Apply: the function called
+        const Pure *callee = nullptr;
+    };
+    struct Pure {
+        const Node *body;
+        usize params, slots;
+    };
+
+    static const unsigned fork_depth = 16;
+
+    Parallel(Term *ast, unsigned threads);
+    ~Parallel();
+
+    // The compiled form of func when it qualifies
+    const Pure* find(Term *func) const {
+        auto it = functions.find(func);
+        return it == functions.end() ? nullptr : &it->second;
+    }
+    i32 call(const Pure *f, const CallKey& args) {
+        return call(f, args.data(), 0);
+    }
+
+    private:
+    struct Task {
+        const Node *expr;
+        const i32 *vars;
+        unsigned depth;
+        i32 value = 0;
+        std::exception_ptr error;
+        std::atomic<bool> done{false};
+    };
+    struct Queue {
+        std::mutex lock;
+        std::deque<Task*> tasks;
+    };
+
+    std::deque<Node> nodes;
+    std::unordered_map<Term*, Pure> functions;
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+    std::atomic<unsigned> sleeping{0};
+    std::atomic<bool> stopping{false};
+
+    const Node* compile(Term *t, Term *func, std::unordered_map<Term*, i32>& slots);
+    // set tells which of vars were assigned
+    bool exec(const Node *block, i32 *vars, bool *set, i32& result, unsigned depth);
+    i32 eval(const Node *n, const i32 *vars, unsigned depth);
+    bool test(const Node *n, const i32 *vars, unsigned depth);
+    i32 call(const Pure *f, const i32 *args, unsigned depth);
+    // Values of the sons of n, in parallel when it forks
+    void operands(const Node *n, const i32 *vars, unsigned depth, i32 *out);
+
+    void spawn(Task *t);
+    void wait(Task *t);
+    void run(Task *t);
+    Task* next();
+    void work(unsigned index);
+};
+
+#endif
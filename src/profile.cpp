@@ -0,0 +1,215 @@
+#include <cstring>
+
+#include "profile.hpp"
+#include "quicken.hpp"
+#include "zitp.hpp"
+
+/*
+ * Profile file: a Header, then 32 bit words
+ *
+ *   functions  per Function: index, calls, repeats, frame, kinds
+ *   marks      per quickened node: index, Mark
+ *
+ * Counts of 64 bits take two words, low word first.
+ */
+
+namespace {
+
+const char magic[8] = {'Z', 'I', 'T', 'P', 'P', 'R', 'O', 'F'};
+const u32 version = 1;
+
+enum Mark : u32 { Quickened = 1, GaveUp = 2 };
+
+struct Header {
+    char magic[8];
+    u64 program;        // FNV-1a of the program text
+    u32 version;
+    u32 nodes;          // Terms in the program
+    u32 functions, marks;
+};
+
+// Calls a function needs before it is worth memoizing
+const u64 memo_calls = 64;
+
+void preorder(Term *t, std::vector<Term*>& out) {
+    out.push_back(t);
+    for (auto son : t->sons) preorder(son, out);
+}
+
+bool rebinds(Term *t, Term *func, Term *self) {
+    if (t->kind == Function && t != func && t->sons.front()->decl == self) return true;
+    if (t->kind == Command && (t->subtype == Assign || t->subtype == Read ||
+                               t->subtype == Declaration)) {
+        for (auto son : t->sons) {
+            if (son->kind == Name && son->decl == self) return true;
+        }
+    }
+    for (auto son : t->sons) {
+        if (rebinds(son, func, self)) return true;
+    }
+    return false;
+}
+
+bool only_locals(Term *t, Term *self, std::vector<Term*>& locals) {
+    if (t->kind == Function) return false;
+    if (t->kind == Command && (t->subtype == Read || t->subtype == Print)) return false;
+    if (t->kind == Command && t->subtype == Declaration) {
+        for (auto var : t->sons) locals.push_back(var->decl);
+    }
+    if (t->kind == Name || (t->kind == Expr && t->subtype == VarName)) {
+        if (!t->decl) return false;
+        if (t->decl != self &&
+            std::find(locals.begin(), locals.end(), t->decl) == locals.end()) {
+            return false;
+        }
+    }
+    for (auto son : t->sons) {
+        if (!only_locals(son, self, locals)) return false;
+    }
+    return true;
+}
+
+// Bodies without calls or loops cost less than a lookup
+bool worth_memoizing(Term *t) {
+    if (t->kind == Expr && t->subtype == Apply) return true;
+    if (t->kind == Command && (t->subtype == Call || t->subtype == While)) return true;
+    for (auto son : t->sons) {
+        if (worth_memoizing(son)) return true;
+    }
+    return false;
+}
+
+u32 word(const std::vector<u32>& words, usize& at) {
+    if (at >= words.size()) throw RuntimeError("Profile is truncated");
+    return words[at++];
+}
+
+u64 wide(const std::vector<u32>& words, usize& at) {
+    u64 low = word(words, at);
+    return low | u64(word(words, at)) << 32;
+}
+
+}
+
+CallArgs::CallArgs(Term *func, Scope *s) {
+    // By name, as a repeated parameter has a single slot holding the last
+    auto last = --func->sons.end();
+    for (auto it = ++func->sons.begin(); it != last; ++it) {
+        const Value *v = s->get_val((*it)->sym).get();
+        u32 kind = v ? v->kind : Null;
+        kinds |= 1u << kind;
+        ints.push_back(kind == Integer ? static_cast<const IntValue*>(v)->value() : 0);
+    }
+}
+
+void Profiler::record(Term *func, const CallArgs& args, usize frame, const Ref<Value>& result) {
+    auto& c = functions[func];
+    ++c.calls;
+    c.frame = std::max<u32>(c.frame, frame);
+    c.kinds |= args.kinds | (1u << (result ? result->kind : Null)) << 8;
+    if (!args.all_ints()) return;
+    if (c.seen.count(args.ints)) {
+        ++c.repeats;
+    } else if (c.seen.size() < seen_limit) {
+        c.seen.insert(args.ints);
+    }
+}
+
+bool pure_function(Term *func, Term *ast) {
+    Term *self = func->sons.front()->decl;
+    std::vector<Term*> locals;
+    auto last = --func->sons.end();
+    for (auto it = ++func->sons.begin(); it != last; ++it) locals.push_back((*it)->decl);
+    return self && only_locals(*last, self, locals) && !rebinds(ast, func, self);
+}
+
+void Zitp::start_profile() {
+    profiler.reset(new Profiler);
+    std::vector<Term*> nodes;
+    preorder(ast, nodes);
+    for (auto t : nodes) {
+        if (t->kind == Function) t->observed = true;
+    }
+}
+
+void Zitp::save_profile() {
+    std::vector<Term*> nodes;
+    preorder(ast, nodes);
+    std::vector<u32> functions, marks;
+    for (u32 i = 0; i < nodes.size(); ++i) {
+        Term *t = nodes[i];
+        auto c = profiler->functions.find(t);
+        if (c != profiler->functions.end()) {
+            auto& n = c->second;
+            functions.insert(functions.end(), {i, u32(n.calls), u32(n.calls >> 32),
+                                               u32(n.repeats), u32(n.repeats >> 32),
+                                               n.frame, n.kinds});
+        }
+        u32 mark = (t->eval ? Quickened : 0) | (t->deopts >= Quick::max_deopts ? GaveUp : 0);
+        if (mark) marks.insert(marks.end(), {i, mark});
+    }
+
+    Header h;
+    memcpy(h.magic, magic, sizeof(magic));
+    h.program = program_hash();
+    h.version = version;
+    h.nodes = nodes.size();
+    h.functions = profiler->functions.size();
+    h.marks = marks.size() / 2;
+
+    std::ofstream ofs(record_file, std::ios::binary | std::ios::trunc);
+    ofs.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    ofs.write(reinterpret_cast<const char*>(functions.data()), functions.size() * sizeof(u32));
+    ofs.write(reinterpret_cast<const char*>(marks.data()), marks.size() * sizeof(u32));
+    if (!ofs) {
+        throw RuntimeError("Failed to write " + record_file);
+    }
+}
+
+void Zitp::apply_profile() {
+    std::ifstream ifs(profile_file, std::ios::binary);
+    if (!ifs) {
+        throw RuntimeError("Failed to open " + profile_file);
+    }
+    Header h;
+    if (!ifs.read(reinterpret_cast<char*>(&h), sizeof(h)) ||
+        memcmp(h.magic, magic, sizeof(magic)) || h.version != version) {
+        throw RuntimeError(profile_file + " is not a profile");
+    }
+    std::vector<Term*> nodes;
+    preorder(ast, nodes);
+    if (h.program != program_hash() || h.nodes != nodes.size()) {
+        throw RuntimeError(profile_file + " was recorded from another program");
+    }
+    std::vector<u32> words;
+    u32 w;
+    while (ifs.read(reinterpret_cast<char*>(&w), sizeof(w))) words.push_back(w);
+
+    usize at = 0;
+    auto node = [&](TermKind kind) {
+        u32 i = word(words, at);
+        if (i >= nodes.size() || (kind == Function && nodes[i]->kind != Function)) {
+            throw RuntimeError("Profile is corrupt");
+        }
+        return nodes[i];
+    };
+    for (u32 i = 0; i < h.functions; ++i) {
+        Term *func = node(Function);
+        u64 calls = wide(words, at), repeats = wide(words, at);
+        u32 frame = word(words, at), kinds = word(words, at);
+        func->frame = std::min<u32>(frame, UINT16_MAX);
+        bool ints = !(kinds & 0xff & ~(1u << Integer)) && kinds >> 8 == 1u << Integer;
+        if (calls >= memo_calls && repeats * 2 >= calls && ints &&
+            worth_memoizing(func->sons.back()) && pure_function(func, ast)) {
+            func->observed = true;
+            memos[func];
+        }
+    }
+    for (u32 i = 0; i < h.marks; ++i) {
+        Term *t = node(Expr);
+        u32 mark = word(words, at);
+        // The next generic execution specializes it
+        if (mark & Quickened) t->hits = Quick::threshold - 1;
+        if (mark & GaveUp) t->deopts = Quick::max_deopts;
+    }
+}
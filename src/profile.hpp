@@ -0,0 +1,85 @@
+#ifndef ZITP_PROFILE_H
+#define ZITP_PROFILE_H
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "Term.hpp"
+#include "value.hpp"
+
+/*
+ * Execution profile of a program, see --record-profile and --use-profile.
+ *
+ * Recording counts the calls of every Function, how large their scopes
+ * grew, the kinds of values passed to and returned from them and how many
+ * calls repeated the arguments of an earlier one. When the run ends it also
+ * notes which nodes quickened and which gave up after deoptimizing.
+ *
+ * Applying a profile before running seeds quickening, so those nodes
+ * specialize on their first execution and the others never speculate,
+ * reserves call scopes at their recorded size and memoizes hot functions
+ * that are pure, take and return integers and were mostly called with
+ * repeated arguments. Nodes are keyed by their index in a preorder walk,
+ * so a profile only applies to the program text it was recorded from.
+ */
+
+// Integer arguments of a call, the key of a memoized result
+typedef std::vector<i32> CallKey;
+
+struct CallKeyHash {
+    size_t operator()(const CallKey& key) const {
+        size_t h = key.size();
+        for (auto n : key) h = h * 1000003 ^ u32(n);
+        return h;
+    }
+};
+
+// Arguments of a call as bound in the scope it runs in
+struct CallArgs {
+    CallKey ints;       // Their values, meaningful when all are integers
+    u32 kinds = 0;      // Bit per ValueKind passed
+
+    CallArgs(Term *func, Scope *s);
+    bool all_ints() const { return !(kinds & ~(1u << Integer)); }
+};
+
+// Results of a pure function by its arguments
+class Memo {
+    std::unordered_map<CallKey, i32, CallKeyHash> results;
+    public:
+    static const usize limit = 1 << 20;
+    bool find(const CallKey& key, i32& result) const {
+        auto it = results.find(key);
+        if (it == results.end()) return false;
+        result = it->second;
+        return true;
+    }
+    void store(const CallKey& key, i32 result) {
+        if (results.size() < limit) results.emplace(key, result);
+    }
+};
+
+class Profiler {
+    public:
+    struct Counts {
+        u64 calls = 0;
+        u64 repeats = 0;        // Calls with integer arguments seen before
+        u32 frame = 0;          // Capacity of its largest call scope
+        u32 kinds = 0;          // Bit per ValueKind passed, results shifted by 8
+        std::unordered_set<CallKey, CallKeyHash> seen;
+    };
+    // Distinct arguments remembered per function
+    static const usize seen_limit = 1 << 16;
+
+    std::unordered_map<Term*, Counts> functions;
+
+    void record(Term *func, const CallArgs& args, usize frame, const Ref<Value>& result);
+};
+
+// Whether calling func twice with the same integers gives the same result
+// and does nothing else: it reads no name but its own variables and itself,
+// prints or reads nothing and defines no functions
+bool pure_function(Term *func, Term *ast);
+
+#endif
@@ -0,0 +1,139 @@
+#include <functional>
+
+#include "quicken.hpp"
+#include "zitp.hpp"
+
+namespace {
+
+// Where the generic lookup finds the name right now
+bool locate(Term *name, Scope *s) {
+    usize before = s->count_vars();
+    for (uint16_t depth = 0; s && depth != UINT16_MAX; ++depth) {
+        auto n = std::min(before, s->count_vars());
+        for (usize i = 0; i < n; ++i) {
+            if (s->map[i].first != name->sym) continue;
+            name->depth = depth;
+            name->slot = i;
+            return true;
+        }
+        before = s->visible;
+        s = s->outer;
+    }
+    return false;
+}
+
+// The variable a located name points at, if that slot still holds it
+const Ref<Value>* fetch(Term *name, Scope *s) {
+    usize before = s->count_vars();
+    for (auto d = name->depth; d; --d) {
+        before = s->visible;
+        s = s->outer;
+        if (!s) return nullptr;
+    }
+    if (name->slot >= std::min(before, s->count_vars())) return nullptr;
+    auto& var = s->map[name->slot];
+    if (var.first != name->sym) return nullptr;
+    if (var.second->kind == Box) {
+        return &static_cast<BoxValue*>(var.second.get())->val;
+    }
+    return &var.second;
+}
+
+}
+
+struct QuickHandlers {
+    static i32 deopt(Zitp& z, Term *t, Scope *s) {
+        t->eval = nullptr;
+        t->hits = 0;
+        ++t->deopts;
+        return z.eval_int(t, s);
+    }
+
+    static i32 constant(Zitp&, Term *t, Scope*) {
+        return t->number;
+    }
+
+    static i32 local_int(Zitp& z, Term *t, Scope *s) {
+        auto var = fetch(t, s);
+        if (!var || (*var)->kind != Integer) return deopt(z, t, s);
+        return static_cast<const IntValue*>(var->get())->value();
+    }
+
+    template <class Op>
+    static i32 int_const(Zitp& z, Term *t, Scope *s) {
+        return Op()(z.eval_int(t->sons.front(), s), t->sons.back()->number);
+    }
+
+    template <class Op>
+    static i32 int_int(Zitp& z, Term *t, Scope *s) {
+        i32 l = z.eval_int(t->sons.front(), s);
+        return Op()(l, z.eval_int(t->sons.back(), s));
+    }
+
+    static i32 direct_call(Zitp& z, Term *t, Scope *s) {
+        auto var = fetch(t->sons.front(), s);
+        if (!var || (*var)->kind != Func) return deopt(z, t, s);
+        auto fv = static_cast<const FuncValue*>(var->get());
+        if (fv->value() != t->target) return deopt(z, t, s);
+        // The call may rebind the name
+        Ref<Value> callee(*var);
+        Zitp::CallDepth guard(z);
+        Scope call(fv->outer.get(), fv->visible);
+        z.enter_call(callee, t, &call, s);
+        Term *func = t->target;
+        if (func->observed) {
+            auto body = [&] { return z.execute_program(func->sons.back(), &call); };
+            return Zitp::checked_int(z.observe_call(func, &call, body), t);
+        }
+        return Zitp::checked_int(z.execute_program(func->sons.back(), &call), t);
+    }
+
+    // Division keeps the generic path unless it divides by a nonzero constant
+    template <class Op>
+    static IntHandler binary(Term *t, bool divides) {
+        Term *r = t->sons.back();
+        if (r->kind == Expr && r->subtype == Number) {
+            return divides && r->number == 0 ? nullptr : int_const<Op>;
+        }
+        return divides ? nullptr : int_int<Op>;
+    }
+};
+
+void Quick::specialize(Term *t, Scope *current) {
+    typedef QuickHandlers H;
+    if (t->deopts >= max_deopts) return;
+    switch (t->subtype) {
+        case Number:
+            t->eval = H::constant;
+            break;
+        case VarName:
+            if (locate(t, current)) t->eval = H::local_int;
+            break;
+        case Plus:
+            t->eval = H::binary<std::plus<i32>>(t, false);
+            break;
+        case Minus:
+            t->eval = H::binary<std::minus<i32>>(t, false);
+            break;
+        case Mult:
+            t->eval = H::binary<std::multiplies<i32>>(t, false);
+            break;
+        case Div:
+            t->eval = H::binary<std::divides<i32>>(t, true);
+            break;
+        case Mod:
+            t->eval = H::binary<std::modulus<i32>>(t, true);
+            break;
+        case Apply: {
+            Term *name = t->sons.front();
+            if (!locate(name, current)) break;
+            auto var = fetch(name, current);
+            if (!var || (*var)->kind != Func) break;
+            t->target = static_cast<const FuncValue*>(var->get())->value();
+            t->eval = H::direct_call;
+            break;
+        }
+        default:
+            break;
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef ZITP_QUICKEN_H
+#define ZITP_QUICKEN_H
+
+#include "Term.hpp"
+
+/*
+ * Node quickening for integer expressions.
+ *
+ * After a few generic executions Zitp::eval_int asks specialize() for a
+ * handler tailored to what the node has seen so far and stores it in
+ * Term::eval. Constants and arithmetic on a constant operand only depend
+ * on the tree. A variable becomes a fixed slot a fixed number of scopes
+ * up, and an Apply a direct call to the function it found. Those two are
+ * speculations: the handler checks that the slot still holds that name
+ * (and an integer, or that function) and otherwise deoptimizes back to
+ * the generic path. A node that deoptimizes too often stays generic.
+ *
+ * Handlers are written into the shared tree, so only interpreters that
+ * own their tree, or share it on one thread, may quicken.
+ */
+struct Quick {
+    static const uint8_t threshold = 2;
+    static const uint8_t max_deopts = 4;
+
+    static void specialize(Term *t, Scope *current);
+};
+
+#endif
@@ -0,0 +1,469 @@
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.hpp"
+#include "symbol.hpp"
+#include "zitp.hpp"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::string;
+
+u64 program_hash(const string& text) {
+    u64 h = 14695981039346656037ULL;
+    for (unsigned char c : text) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+string program_id(const string& text) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)program_hash(text));
+    return string(buf);
+}
+
+ProgramCache::handle ProgramCache::find(u64 key) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = programs.find(key);
+    if (it == programs.end()) return nullptr;
+    return it->second;
+}
+
+ProgramCache::handle ProgramCache::find(const string& text) {
+    auto p = find(program_hash(text));
+    return p && p->text == text ? p : nullptr;
+}
+
+ProgramCache::handle ProgramCache::insert(const string& text, Term *ast) {
+    u64 key = program_hash(text);
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = programs.find(key);
+    if (it != programs.end()) {
+        // Another worker parsed the same program first, or a colliding one
+        delete ast;
+        return it->second->text == text ? it->second : nullptr;
+    }
+    // Evict the oldest program, runs still holding it keep it alive
+    while (programs.size() >= capacity && !order.empty()) {
+        programs.erase(order.front());
+        order.pop_front();
+    }
+    auto p = std::make_shared<Program>(text, ast);
+    programs.emplace(key, p);
+    order.push_back(key);
+    return p;
+}
+
+usize ProgramCache::size() {
+    std::lock_guard<std::mutex> guard(lock);
+    return programs.size();
+}
+
+void LatencyStats::record(u64 usec) {
+    int b = 0;
+    while (b < nbuckets - 1 && ((u64)1 << b) <= usec) ++b;
+    std::lock_guard<std::mutex> guard(lock);
+    ++buckets[b];
+    ++count;
+    total += usec;
+    if (usec > max) max = usec;
+}
+
+// Upper bound of the bucket holding the p-th percentile
+u64 LatencyStats::percentile(double p) const {
+    u64 want = (u64)(count * p + 0.999999);
+    u64 seen = 0;
+    for (int b = 0; b < nbuckets; ++b) {
+        seen += buckets[b];
+        if (seen >= want && seen != 0) return std::min((u64)1 << b, max);
+    }
+    return max;
+}
+
+string LatencyStats::report() {
+    std::lock_guard<std::mutex> guard(lock);
+    std::ostringstream os;
+    os << "requests " << count << '\n'
+       << "latency_avg_us " << (count ? total / count : 0) << '\n'
+       << "latency_p50_us " << percentile(0.50) << '\n'
+       << "latency_p90_us " << percentile(0.90) << '\n'
+       << "latency_p99_us " << percentile(0.99) << '\n'
+       << "latency_max_us " << max << '\n';
+    return os.str();
+}
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void on_signal(int) {
+    interrupted = 1;
+}
+
+// Buffered reader and writer over a connected socket
+class Channel {
+    int fd;
+    string buf;
+    usize pos = 0;
+
+    bool fill() {
+        char tmp[4096];
+        ssize_t n;
+        do {
+            n = ::read(fd, tmp, sizeof(tmp));
+            // Idle clients time out periodically so shutdown is noticed
+        } while (n < 0 && (errno == EINTR || errno == EAGAIN) && !interrupted);
+        if (n <= 0) return false;
+        if (pos == buf.size()) {
+            buf.clear();
+            pos = 0;
+        }
+        buf.append(tmp, n);
+        return true;
+    }
+
+    public:
+    Channel(int f): fd(f) {}
+
+    bool read_line(string& line) {
+        for (;;) {
+            auto nl = buf.find('\n', pos);
+            if (nl != string::npos) {
+                line.assign(buf, pos, nl - pos);
+                pos = nl + 1;
+                return true;
+            }
+            if (!fill()) return false;
+        }
+    }
+
+    bool read_bytes(usize len, string& out) {
+        while (buf.size() - pos < len) {
+            if (!fill()) return false;
+        }
+        out.assign(buf, pos, len);
+        pos += len;
+        return true;
+    }
+
+    bool write_all(const string& data) {
+        usize done = 0;
+        while (done < data.size()) {
+            ssize_t n = ::send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += n;
+        }
+        return true;
+    }
+
+    bool reply(bool ok, const string& payload) {
+        return write_all((ok ? "OK " : "ERR ") + std::to_string(payload.size())
+                         + "\n" + payload);
+    }
+
+    // Parses a reply written by the function above
+    bool read_reply(bool& ok, string& payload) {
+        string line;
+        if (!read_line(line)) return false;
+        std::istringstream is(line);
+        string status;
+        usize len = 0;
+        if (!(is >> status >> len)) return false;
+        ok = status == "OK";
+        return read_bytes(len, payload);
+    }
+};
+
+Server::Server(const string& sock, unsigned workers, usize backlog, usize cache_size):
+    path(sock), nworkers(workers ? workers : 1), backlog(backlog), listen_fd(-1),
+    cache(cache_size), max_request(default_max_request), hits(0), misses(0), failures(0), rejected(0),
+    stopping(false)
+{
+}
+
+int Server::serve() {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        cerr << "ERROR: Socket path too long: " << path << endl;
+        return 1;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        cerr << "ERROR: socket: " << strerror(errno) << endl;
+        return 1;
+    }
+    unlink(path.c_str());
+    if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(listen_fd, 128) < 0) {
+        cerr << "ERROR: Cannot listen on " << path << ": " << strerror(errno) << endl;
+        close(listen_fd);
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, worker_stack);
+    for (unsigned i = 0; i < nworkers; ++i) {
+        pthread_t t;
+        if (pthread_create(&t, &attr, start_worker, this) == 0) workers.push_back(t);
+    }
+    pthread_attr_destroy(&attr);
+    if (workers.empty()) {
+        cerr << "ERROR: Cannot start workers" << endl;
+        close(listen_fd);
+        unlink(path.c_str());
+        return 1;
+    }
+    cout << "Serving on " << path << " with " << nworkers << " workers" << endl;
+
+    pollfd pfd = { listen_fd, POLLIN, 0 };
+    while (!interrupted) {
+        // Wake up periodically to notice signals
+        if (poll(&pfd, 1, 200) <= 0) continue;
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) continue;
+        timeval tv = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        std::unique_lock<std::mutex> guard(lock);
+        if (pending.size() >= backlog) {
+            // Backpressure: tell the client to retry instead of queueing
+            guard.unlock();
+            ++rejected;
+            Channel(fd).reply(false, "busy");
+            close(fd);
+            continue;
+        }
+        pending.push_back(fd);
+        guard.unlock();
+        ready.notify_one();
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (auto t : workers) pthread_join(t, nullptr);
+    close(listen_fd);
+    unlink(path.c_str());
+    cout << stats();
+    return 0;
+}
+
+void* Server::start_worker(void *server) {
+    static_cast<Server*>(server)->work();
+    return nullptr;
+}
+
+void Server::work() {
+    for (;;) {
+        int fd;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            ready.wait(guard, [this] { return stopping || !pending.empty(); });
+            if (pending.empty()) return;
+            fd = pending.front();
+            pending.pop_front();
+        }
+        serve_client(fd);
+        close(fd);
+    }
+}
+
+void Server::serve_client(int fd) {
+    Channel ch(fd);
+    string line;
+    while (!interrupted && ch.read_line(line)) {
+        std::istringstream is(line);
+        string cmd, id;
+        usize len = 0;
+        is >> cmd;
+        bool load = cmd == "LOAD" && is >> len;
+        bool run = cmd == "RUN" && is >> id >> len;
+        if ((load || run) && len > max_request) {
+            // Its payload is left unread, so nothing after it can be parsed
+            ch.reply(false, "request over " + std::to_string(max_request) + " bytes");
+            return;
+        }
+        bool alive;
+        if (load) {
+            alive = handle_load(ch, len);
+        }
+        else if (run) {
+            alive = handle_run(ch, id, len);
+        }
+        else if (cmd == "STATS") {
+            alive = ch.reply(true, stats());
+        }
+        else {
+            alive = ch.reply(false, "bad request: " + line);
+        }
+        if (!alive) return;
+    }
+}
+
+bool Server::handle_load(Channel& ch, usize len) {
+    string text;
+    if (!ch.read_bytes(len, text)) return false;
+    if (cache.find(text)) {
+        ++hits;
+        return ch.reply(true, program_id(text));
+    }
+    ++misses;
+    if (symbol_count() >= max_symbols) {
+        ++failures;
+        return ch.reply(false, "symbol table full");
+    }
+    std::istringstream is(text);
+    Term *ast = parse(is);
+    if (!ast) {
+        ++failures;
+        return ch.reply(false, "parse failed");
+    }
+    try {
+        Zitp::prepare(ast);
+    } catch (const RuntimeError& e) {
+        delete ast;
+        ++failures;
+        return ch.reply(false, e.what());
+    }
+    if (!cache.insert(text, ast)) {
+        ++failures;
+        return ch.reply(false, "hash collision with a cached program");
+    }
+    return ch.reply(true, program_id(text));
+}
+
+bool Server::handle_run(Channel& ch, const string& id, usize len) {
+    string input;
+    if (!ch.read_bytes(len, input)) return false;
+    auto start = std::chrono::steady_clock::now();
+
+    char *end_id = nullptr;
+    u64 key = strtoull(id.c_str(), &end_id, 16);
+    auto prog = *end_id == '\0' ? cache.find(key) : nullptr;
+    if (!prog) {
+        return ch.reply(false, "unknown program " + id);
+    }
+    std::istringstream is(input);
+    std::ostringstream os;
+    bool ok = true;
+    string result;
+    try {
+        Zitp z(prog->ast, is, os);
+        z.set_engine(TreeEngine);
+        // Recursing past the worker stack would take the whole server down
+        Budget b = budget;
+        if (!b.depth || b.depth > default_depth) b.depth = default_depth;
+        z.set_budget(b);
+        z.run();
+        result = os.str();
+    } catch (const RuntimeError& e) {
+        ++failures;
+        ok = false;
+        result = e.what();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    latency.record(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+    return ch.reply(ok, result);
+}
+
+string Server::stats() {
+    std::ostringstream os;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        os << "queued " << pending.size() << '\n';
+    }
+    os << "workers " << nworkers << '\n'
+       << "cached_programs " << cache.size() << '\n'
+       << "cache_hits " << hits << '\n'
+       << "cache_misses " << misses << '\n'
+       << "failures " << failures << '\n'
+       << "rejected " << rejected << '\n'
+       << latency.report();
+    return os.str();
+}
+
+static bool slurp(const char *file, string& text) {
+    std::ifstream ifs(file, std::ios::binary);
+    if (!ifs) return false;
+    std::ostringstream os;
+    os << ifs.rdbuf();
+    text = os.str();
+    return true;
+}
+
+int run_remote(const char *sock, const char *prog, const char *in, const char *out) {
+    string program, input;
+    if (!prog) prog = "program.txt";
+    if (!in) in = "input.txt";
+    if (!out) out = "output.txt";
+    if (!slurp(prog, program)) {
+        cerr << prog << " cannot be found" << endl;
+        return 1;
+    }
+    // A program without Read does not need its input file
+    slurp(in, input);
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sock, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        cerr << "ERROR: Cannot connect to " << sock << ": " << strerror(errno) << endl;
+        return 1;
+    }
+
+    Channel ch(fd);
+    string id = program_id(program), payload;
+    bool ok = false;
+    string run = "RUN " + id + " " + std::to_string(input.size()) + "\n" + input;
+    if (!ch.write_all(run) || !ch.read_reply(ok, payload)) goto broken;
+    if (!ok && payload.compare(0, 15, "unknown program") == 0) {
+        // Cold program: upload it once and retry
+        string load = "LOAD " + std::to_string(program.size()) + "\n" + program;
+        if (!ch.write_all(load) || !ch.read_reply(ok, payload)) goto broken;
+        if (ok) {
+            if (!ch.write_all(run) || !ch.read_reply(ok, payload)) goto broken;
+        }
+    }
+    close(fd);
+    if (!ok) {
+        cerr << "ERROR: " << payload << endl;
+        return 1;
+    }
+    {
+        std::ofstream ofs(out, std::ios::binary);
+        ofs << payload;
+    }
+    return 0;
+
+broken:
+    close(fd);
+    cerr << "ERROR: Connection to " << sock << " lost" << endl;
+    return 1;
+}
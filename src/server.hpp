@@ -0,0 +1,132 @@
+#ifndef ZITP_SERVER_H
+#define ZITP_SERVER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Term.hpp"
+#include "value.hpp"
+#include "zitp.hpp"
+
+/*
+ * Wire protocol, one request after another on a stream socket:
+ *
+ *   LOAD <n>\n<n bytes of program>      -> OK with the program id
+ *   RUN <id> <n>\n<n bytes of input>    -> OK with the program output
+ *   STATS\n                             -> OK with the server metrics
+ *
+ * Every reply is "OK <n>\n" or "ERR <n>\n" followed by n bytes of payload.
+ * The program id is the FNV-1a hash of the program text in hex, so a
+ * client can RUN without a LOAD round trip if the program is warm. A LOAD
+ * whose text collides with another cached program gets ERR, and one whose
+ * n is over the server's request limit gets ERR and the connection closed.
+ */
+
+u64 program_hash(const std::string& text);
+std::string program_id(const std::string& text);
+
+// Parsed programs keyed by the hash of their source text. The text is kept
+// too, so two programs whose hashes collide are never taken for each other.
+class ProgramCache {
+    struct Program {
+        std::string text;
+        Term *ast;
+        Program(const std::string& s, Term *t): text(s), ast(t) {}
+        ~Program() { delete ast; }
+    };
+
+    std::mutex lock;
+    usize capacity;
+    std::deque<u64> order;
+    std::unordered_map<u64, std::shared_ptr<Program>> programs;
+
+    public:
+    typedef std::shared_ptr<Program> handle;
+
+    ProgramCache(usize cap): capacity(cap) {}
+
+    handle find(u64 key);
+    // Nullptr unless the program cached under the hash of text is text
+    handle find(const std::string& text);
+    // Takes ast, nullptr if another text with the same hash is cached
+    handle insert(const std::string& text, Term *ast);
+    usize size();
+};
+
+// Request latencies bucketed by powers of two microseconds
+class LatencyStats {
+    static const int nbuckets = 32;
+
+    std::mutex lock;
+    u64 buckets[nbuckets] = {};
+    u64 count = 0;
+    u64 total = 0;
+    u64 max = 0;
+
+    u64 percentile(double p) const;
+
+    public:
+    void record(u64 usec);
+    std::string report();
+};
+
+class Channel;
+
+class Server {
+    std::string path;
+    unsigned nworkers;
+    usize backlog;
+    int listen_fd;
+
+    ProgramCache cache;
+    LatencyStats latency;
+    Budget budget;
+    usize max_request;
+    std::atomic<u64> hits, misses, failures, rejected;
+
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<int> pending;
+    bool stopping;
+    std::vector<pthread_t> workers;
+
+    static void* start_worker(void *server);
+    void work();
+    void serve_client(int fd);
+    bool handle_load(Channel& ch, usize len);
+    bool handle_run(Channel& ch, const std::string& id, usize len);
+    std::string stats();
+
+    public:
+    // Workers run on stacks holding default_depth calls; no RUN nests calls
+    // deeper, whatever its budget
+    static const u32 default_depth = 10000;
+    static const usize worker_stack = Zitp::stack_for(default_depth);
+    static const usize default_max_request = 16 << 20;
+    // Interned identifiers are never freed, so past this many no program
+    // is loaded any more; each worker keeps its own copy of those it saw
+    static const u32 max_symbols = 1 << 20;
+
+    Server(const std::string& sock, unsigned workers, usize backlog, usize cache_size);
+
+    // Limits every RUN, one going over it gets ERR with the limit hit
+    void set_budget(const Budget& b) { budget = b; }
+
+    // Most bytes of program or input a LOAD or RUN may send
+    void set_max_request(usize bytes) { max_request = bytes; }
+
+    // Blocks until SIGINT or SIGTERM, returns the process exit code
+    int serve();
+};
+
+// Minimal client: runs a program through the server at sock
+int run_remote(const char *sock, const char *prog, const char *in, const char *out);
+
+#endif
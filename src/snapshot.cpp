@@ -0,0 +1,339 @@
+#include <cstring>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "zitp.hpp"
+#include "symbol.hpp"
+
+using std::cerr;
+using std::endl;
+
+/*
+ * Snapshot file: a Header, then 32 bit words
+ *
+ *   printed    the integers printed so far
+ *   symbols    per name its length and bytes, padded to a word
+ *   objects    one record per value or closure environment, by id
+ *   globals    per variable of the global scope its symbol and value id
+ *
+ * Records start with their kind:
+ *
+ *   Int n | Bool b | Null | Box target | Func function env visible
+ *   Env visible count (symbol value)*
+ *
+ * Functions are their index in a preorder walk of the program, env is the
+ * id of the closure environment or NoId when the function only sees the
+ * global scope. Records may refer to later ids, boxes can form cycles.
+ */
+
+namespace {
+
+const char magic[8] = {'Z', 'I', 'T', 'P', 'S', 'N', 'A', 'P'};
+const u32 version = 1;
+const u32 NoId = ~0u;
+
+enum Record : u32 { IntRecord, BoolRecord, NullRecord, BoxRecord, FuncRecord, EnvRecord };
+
+struct Header {
+    char magic[8];
+    u64 program;        // FNV-1a of the program text
+    u32 version;
+    u32 resume;         // Top-level command to continue from, a Read
+    u32 functions;      // Function terms in the program
+    u32 printed, symbols, objects, globals;
+    u32 words;          // Words following the header
+};
+
+void functions_of(Term *t, std::vector<Term*>& out) {
+    if (t->kind == Function) out.push_back(t);
+    for (auto son : t->sons) functions_of(son, out);
+}
+
+// Gives ids to everything reachable from the global scope
+class Writer {
+    Scope *top;
+    std::unordered_map<Term*, u32> functions;
+    std::unordered_map<const void*, u32> ids;
+    std::unordered_map<u32, u32> syms;
+
+    public:
+    std::vector<std::vector<u32>> objects;
+    std::vector<u32> names;
+
+    Writer(Scope *t, const std::vector<Term*>& funcs): top(t) {
+        for (u32 i = 0; i < funcs.size(); ++i) functions[funcs[i]] = i;
+    }
+
+    u32 symbol(u32 sym) {
+        auto it = syms.find(sym);
+        if (it != syms.end()) return it->second;
+        u32 id = syms.size();
+        syms[sym] = id;
+        names.push_back(sym);
+        return id;
+    }
+
+    u32 value(const Ref<Value>& v) {
+        if (!v) return NoId;
+        auto it = ids.find(v.get());
+        if (it != ids.end()) return it->second;
+        u32 id = objects.size();
+        ids[v.get()] = id;
+        objects.emplace_back();
+        std::vector<u32> rec;
+        switch (v->kind) {
+            case Integer:
+                rec = {IntRecord, u32(static_cast<const IntValue*>(v.get())->value())};
+                break;
+            case Boolean:
+                rec = {BoolRecord, static_cast<const BoolValue*>(v.get())->value()};
+                break;
+            case Null:
+                rec = {NullRecord};
+                break;
+            case Box:
+                rec = {BoxRecord, value(static_cast<const BoxValue*>(v.get())->val)};
+                break;
+            case Func: {
+                auto fv = static_cast<const FuncValue*>(v.get());
+                auto func = functions.find(fv->value());
+                if (func == functions.end()) {
+                    throw RuntimeError("function outside the program");
+                }
+                u32 env = fv->outer.get() == top ? NoId : scope(fv->outer.get());
+                rec = {FuncRecord, func->second, env, u32(fv->visible)};
+                break;
+            }
+        }
+        objects[id] = std::move(rec);
+        return id;
+    }
+
+    // Closure environments, whose outer is always the global scope
+    u32 scope(Scope *s) {
+        auto it = ids.find(s);
+        if (it != ids.end()) return it->second;
+        if (s->outer != top) {
+            throw RuntimeError("function defined in a running block");
+        }
+        u32 id = objects.size();
+        ids[s] = id;
+        objects.emplace_back();
+        std::vector<u32> rec = {EnvRecord, u32(s->visible), u32(s->map.size())};
+        for (auto& var : s->map) {
+            rec.push_back(symbol(var.first));
+            rec.push_back(value(var.second));
+        }
+        objects[id] = std::move(rec);
+        return id;
+    }
+};
+
+// Reads the words of a mapped snapshot, checking every access
+class Reader {
+    const u32 *p, *end;
+    public:
+    Reader(const u32 *b, const u32 *e): p(b), end(e) {}
+    u32 next() {
+        if (p == end) throw RuntimeError("Snapshot is truncated");
+        return *p++;
+    }
+    const char* bytes(u32 n) {
+        u64 words = (u64(n) + 3) / 4;
+        if (u64(end - p) < words) throw RuntimeError("Snapshot is truncated");
+        auto s = reinterpret_cast<const char*>(p);
+        p += words;
+        return s;
+    }
+    const u32* here() const { return p; }
+    void seek(const u32 *q) { p = q; }
+};
+
+struct Mapping {
+    void *addr = MAP_FAILED;
+    size_t size = 0;
+    ~Mapping() {
+        if (addr != MAP_FAILED) munmap(addr, size);
+    }
+};
+
+}
+
+void Zitp::take_snapshot(Term *read, Scope *root) {
+    snapshot_pending = false;
+    std::vector<i32> printed;
+    printed.swap(printed_values);
+    if (read->father != ast) {
+        cerr << "WARNING: The first Read is not at the top level, no snapshot taken" << endl;
+        return;
+    }
+    u32 resume = 0;
+    for (auto cmd : ast->sons) {
+        if (cmd == read) break;
+        ++resume;
+    }
+
+    std::vector<Term*> funcs;
+    functions_of(ast, funcs);
+    Writer w(root, funcs);
+    std::vector<u32> globals;
+    try {
+        for (auto& var : root->map) {
+            globals.push_back(w.symbol(var.first));
+            globals.push_back(w.value(var.second));
+        }
+    } catch (const RuntimeError& e) {
+        cerr << "WARNING: No snapshot taken, " << e.what() << endl;
+        return;
+    }
+
+    std::vector<u32> words(printed.begin(), printed.end());
+    for (auto sym : w.names) {
+        auto& name = symbol_name(sym);
+        words.push_back(name.size());
+        auto at = words.size();
+        words.resize(at + (name.size() + 3) / 4);
+        memcpy(&words[at], name.data(), name.size());
+    }
+    for (auto& rec : w.objects) words.insert(words.end(), rec.begin(), rec.end());
+    words.insert(words.end(), globals.begin(), globals.end());
+
+    Header h;
+    memcpy(h.magic, magic, sizeof(magic));
+    h.program = program_hash();
+    h.version = version;
+    h.resume = resume;
+    h.functions = funcs.size();
+    h.printed = printed.size();
+    h.symbols = w.names.size();
+    h.objects = w.objects.size();
+    h.globals = root->map.size();
+    h.words = words.size();
+
+    std::ofstream ofs(snapshot_file, std::ios::binary | std::ios::trunc);
+    ofs.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    ofs.write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(u32));
+    if (!ofs) {
+        throw RuntimeError("Failed to write " + snapshot_file);
+    }
+}
+
+usize Zitp::restore_snapshot(Scope *top) {
+    int fd = open(restore_file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw RuntimeError("Failed to open " + restore_file);
+    }
+    Mapping m;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && usize(st.st_size) >= sizeof(Header)) {
+        m.size = st.st_size;
+        m.addr = mmap(nullptr, m.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (m.addr == MAP_FAILED) {
+        throw RuntimeError("Failed to map " + restore_file);
+    }
+
+    const Header& h = *static_cast<const Header*>(m.addr);
+    std::vector<Term*> funcs;
+    functions_of(ast, funcs);
+    if (memcmp(h.magic, magic, sizeof(magic)) || h.version != version) {
+        throw RuntimeError(restore_file + " is not a snapshot");
+    }
+    if (h.program != program_hash() || h.functions != funcs.size() ||
+        h.resume >= ast->sons.size()) {
+        throw RuntimeError(restore_file + " was taken from another program");
+    }
+    auto base = reinterpret_cast<const u32*>(&h + 1);
+    if ((m.size - sizeof(Header)) / sizeof(u32) < h.words) {
+        throw RuntimeError("Snapshot is truncated");
+    }
+    Reader r(base, base + h.words);
+
+    for (u32 i = 0; i < h.printed; ++i) print_int(i32(r.next()));
+    std::vector<u32> syms;
+    for (u32 i = 0; i < h.symbols; ++i) {
+        u32 n = r.next();
+        syms.push_back(intern(std::string(r.bytes(n), n)));
+    }
+    auto sym = [&](u32 id) {
+        if (id >= syms.size()) throw RuntimeError("Snapshot is corrupt");
+        return syms[id];
+    };
+
+    // Objects are created before they are linked, they may form cycles
+    std::vector<Ref<Value>> values(h.objects);
+    std::vector<Ref<Scope>> envs(h.objects);
+    auto objects = r.here();
+    for (u32 pass = 0; pass < 3; ++pass) {
+        r.seek(objects);
+        for (u32 id = 0; id < h.objects; ++id) {
+            auto get = [&](u32 ref) {
+                if (ref == NoId) return Ref<Value>();
+                if (ref >= h.objects || !values[ref]) throw RuntimeError("Snapshot is corrupt");
+                return values[ref];
+            };
+            switch (r.next()) {
+                case IntRecord: {
+                    i32 n = r.next();
+                    if (pass == 0) values[id] = make_ref<IntValue>(n);
+                    break;
+                }
+                case BoolRecord: {
+                    u32 b = r.next();
+                    if (pass == 0) values[id] = bools[b != 0];
+                    break;
+                }
+                case NullRecord:
+                    if (pass == 0) values[id] = make_ref<NullValue>();
+                    break;
+                case BoxRecord: {
+                    u32 target = r.next();
+                    if (pass == 0) values[id] = make_ref<BoxValue>(Ref<Value>());
+                    if (pass == 2) static_cast<BoxValue*>(values[id].get())->val = get(target);
+                    break;
+                }
+                case FuncRecord: {
+                    u32 index = r.next(), env = r.next(), visible = r.next();
+                    if (pass != 1) break;
+                    if (index >= funcs.size() || (env != NoId && (env >= h.objects || !envs[env]))) {
+                        throw RuntimeError("Snapshot is corrupt");
+                    }
+                    Term *func = funcs[index];
+                    if (env != NoId) {
+                        values[id] = make_ref<FuncValue>(envs[env], visible, func);
+                    } else if (func->escapes) {
+                        values[id] = make_ref<FuncValue>(top, visible, func);
+                    } else {
+                        // Popped with the global scope, as make_closure() does
+                        frames.emplace_back(top, visible, func);
+                        frames.back().refs = 1;
+                        values[id] = Ref<Value>(&frames.back());
+                    }
+                    restored.push_back(static_cast<FuncValue*>(values[id].get()));
+                    break;
+                }
+                case EnvRecord: {
+                    u32 visible = r.next(), n = r.next();
+                    if (pass == 0) envs[id] = Scope::make_env(top, visible);
+                    for (u32 i = 0; i < n; ++i) {
+                        u32 s = r.next(), v = r.next();
+                        if (pass == 2) envs[id]->capture(sym(s), get(v));
+                    }
+                    break;
+                }
+                default:
+                    throw RuntimeError("Snapshot is corrupt");
+            }
+        }
+    }
+    for (u32 i = 0; i < h.globals; ++i) {
+        u32 s = r.next(), v = r.next();
+        if (v >= h.objects) throw RuntimeError("Snapshot is corrupt");
+        top->capture(sym(s), values[v]);
+    }
+    return h.resume;
+}
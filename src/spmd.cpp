@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include "spmd.hpp"
+
+using std::cerr;
+using std::endl;
+
+namespace {
+
+typedef Spmd::Lanes Lanes;
+
+Lanes splat(i32 n) {
+    return Lanes{} + n;
+}
+
+// Plain arrays, so the loops vectorize
+bool any(Lanes m) {
+    u64 words[sizeof(Lanes) / sizeof(u64)], r = 0;
+    memcpy(words, &m, sizeof(Lanes));
+    for (auto w : words) r |= w;
+    return r != 0;
+}
+
+unsigned count(Lanes m) {
+    i32 lanes[Spmd::lanes], n = 0;
+    memcpy(lanes, &m, sizeof(Lanes));
+    // Each lane is 0 or -1
+    for (auto l : lanes) n -= l;
+    return n;
+}
+
+}
+
+Spmd::Spmd(Term *t): ast(t) {
+    std::unordered_map<Term*, i32> slots;
+    if (ast && ast->kind == Block && !ast->lazy) body = compile(ast, slots);
+    this->slots = slots.size();
+}
+
+void Spmd::add(const std::string& input, const std::string& output) {
+    instances.emplace_back();
+    instances.back().input = input;
+    instances.back().output = output;
+}
+
+// Nullptr when t uses anything lanes do not handle
+const Spmd::Node* Spmd::compile(Term *t, std::unordered_map<Term*, i32>& slots) {
+    nodes.emplace_back();
+    Node& n = nodes.back();
+    n.kind = t->kind;
+    n.op = t->subtype;
+    auto add = [&](Term *son) {
+        auto c = compile(son, slots);
+        n.sons.push_back(c);
+        return c != nullptr;
+    };
+    auto slot = [&](Term *name) {
+        auto it = slots.find(name->decl);
+        return it == slots.end() ? -1 : it->second;
+    };
+    switch (t->kind) {
+        case Block:
+            for (auto son : t->sons) {
+                if (!add(son)) return nullptr;
+            }
+            return &n;
+        case Command:
+            switch (t->subtype) {
+                case Declaration:
+                    for (auto var : t->sons) {
+                        if (!var->decl) return nullptr;
+                        slots.emplace(var->decl, slots.size());
+                        n.fresh.push_back(slots[var->decl]);
+                    }
+                    return &n;
+                case Assign:
+                    n.value = slot(t->sons.front());
+                    if (n.value < 0 || t->sons.back()->type != IntType) return nullptr;
+                    return add(t->sons.back()) ? &n : nullptr;
+                case Read:
+                    n.value = slot(t->sons.front());
+                    return n.value < 0 ? nullptr : &n;
+                case Print:
+                case Return:
+                    if (t->sons.front()->subtype == VarName) n.term = t->sons.front();
+                    if (t->sons.front()->type != IntType) return nullptr;
+                    return add(t->sons.front()) ? &n : nullptr;
+                case If:
+                case While:
+                    for (auto son : t->sons) {
+                        if (!add(son)) return nullptr;
+                    }
+                    return &n;
+                default:
+                    return nullptr;
+            }
+        case BoolExpr:
+            for (auto son : t->sons) {
+                if (!add(son)) return nullptr;
+            }
+            return &n;
+        case Expr:
+            switch (t->subtype) {
+                case Number:
+                    n.value = t->number;
+                    return &n;
+                case VarName:
+                    n.value = slot(t);
+                    return n.value < 0 || t->type != IntType ? nullptr : &n;
+                case Apply:
+                    return nullptr;
+                default:
+                    for (auto son : t->sons) {
+                        if (!add(son)) return nullptr;
+                    }
+                    return &n;
+            }
+        default:
+            return nullptr;
+    }
+}
+
+int Spmd::run() {
+    for (usize first = 0; body && first < instances.size(); first += lanes) {
+        run_group(first);
+    }
+    for (usize i = 0; i < instances.size(); ++i) {
+        if (!body || instances[i].dropped) run_scalar(i);
+    }
+    return std::count_if(instances.begin(), instances.end(),
+                         [](const Instance& inst) { return inst.failed; });
+}
+
+void Spmd::run_group(usize first) {
+    group = &instances[first];
+    size = std::min<usize>(lanes, instances.size() - first);
+    vars.assign(slots, Var{});
+    alive = Lanes{};
+    for (unsigned i = 0; i < size; ++i) {
+        group[i].in.open(group[i].input);
+        if (group[i].in) {
+            alive[i] = -1;
+        } else {
+            group[i].error = "Failed to open " + group[i].input;
+            group[i].failed = true;
+        }
+    }
+    exec(body, alive);
+
+    for (unsigned i = 0; i < size; ++i) {
+        Instance& inst = group[i];
+        inst.in.close();
+        if (inst.dropped) continue;
+        ++in_lanes;
+        std::ofstream out(inst.output);
+        if (!out) {
+            inst.error = "Failed to open " + inst.output;
+            inst.failed = true;
+        }
+        out << inst.out;
+        if (!inst.failed) out << endl;
+        cerr << inst.err;
+        if (inst.failed) cerr << "ERROR: instance " << first + i << ": " << inst.error << endl;
+        inst.out = inst.err = std::string();
+    }
+}
+
+void Spmd::run_scalar(usize index) {
+    Instance& inst = instances[index];
+    inst.failed = false;
+    try {
+        std::ifstream in(inst.input);
+        if (!in) throw RuntimeError("Failed to open " + inst.input);
+        std::ofstream out(inst.output);
+        if (!out) throw RuntimeError("Failed to open " + inst.output);
+        Zitp z(ast, in, out);
+        z.set_engine(engine);
+        z.run();
+    } catch (const RuntimeError& e) {
+        cerr << "ERROR: instance " << index << ": " << e.what() << endl;
+        inst.failed = true;
+    }
+}
+
+void Spmd::fail(unsigned lane, const std::string& msg) {
+    if (!alive[lane]) return;
+    alive[lane] = 0;
+    group[lane].error = msg;
+    group[lane].failed = true;
+}
+
+void Spmd::exec(const Node *block, Lanes m) {
+    for (auto st : block->sons) {
+        // Lanes that returned or failed meanwhile
+        m &= alive;
+        if (!any(m)) return;
+        switch (st->op) {
+            case Declaration:
+                for (auto s : st->fresh) {
+                    vars[s].value = m ? Lanes{} : vars[s].value;
+                    vars[s].set &= ~m;
+                }
+                break;
+            case Assign: {
+                Lanes v = eval(st->sons.front(), m);
+                m &= alive;
+                vars[st->value].value = m ? v : vars[st->value].value;
+                vars[st->value].set |= m;
+                break;
+            }
+            case Read:
+                for (unsigned i = 0; i < size; ++i) {
+                    if (!m[i]) continue;
+                    i32 n = 0;
+                    group[i].in >> n;
+                    vars[st->value].value[i] = n;
+                    vars[st->value].set[i] = -1;
+                }
+                break;
+            case Print: {
+                Lanes v = eval(st->sons.front(), m);
+                m &= alive;
+                // An unassigned variable prints nothing
+                Lanes unset = st->term ? m & ~vars[st->sons.front()->value].set : Lanes{};
+                for (unsigned i = 0; i < size; ++i) {
+                    if (unset[i]) {
+                        group[i].err += "ERROR: Invalid kind of var: " + st->term->name() + "\n";
+                    } else if (m[i]) {
+                        auto& inst = group[i];
+                        if (inst.printed) inst.out += ' ';
+                        inst.out += std::to_string(v[i]);
+                        inst.printed = true;
+                    }
+                }
+                break;
+            }
+            case Return: {
+                eval(st->sons.front(), m);
+                m &= alive;
+                // Returning an unassigned variable is an error
+                Lanes unset = st->term ? m & ~vars[st->sons.front()->value].set : Lanes{};
+                for (unsigned i = 0; i < size; ++i) {
+                    if (!unset[i]) continue;
+                    group[i].err += "ERROR: Invalid kind of var: " + st->term->name() + "\n";
+                    fail(i, "Return unexpected value");
+                }
+                alive &= ~m;
+                return;
+            }
+            case If: {
+                Lanes c = test(st->sons[0], m);
+                exec(st->sons[1], m & c);
+                exec(st->sons[2], m & ~c);
+                break;
+            }
+            case While:
+                loop(st, m);
+                break;
+        }
+    }
+}
+
+void Spmd::loop(const Node *st, Lanes m) {
+    unsigned sparse = 0;
+    for (;;) {
+        m &= alive;
+        if (!any(m)) return;
+        m &= test(st->sons[0], m) & alive;
+        unsigned n = count(m);
+        if (!n) return;
+        if (n * sparse_ratio < size && ++sparse > sparse_iterations) {
+            // Too few lanes keep looping, finish them one at a time
+            for (unsigned i = 0; i < size; ++i) {
+                if (!m[i]) continue;
+                group[i].dropped = true;
+                group[i].out = group[i].err = std::string();
+                group[i].printed = false;
+                ++dropped;
+            }
+            alive &= ~m;
+            return;
+        }
+        if (n * sparse_ratio >= size) sparse = 0;
+        exec(st->sons[1], m);
+    }
+}
+
+Spmd::Lanes Spmd::eval(const Node *n, Lanes m) {
+    switch (n->op) {
+        case Number:
+            return splat(n->value);
+        case VarName:
+            return vars[n->value].value;
+    }
+    Lanes l = eval(n->sons[0], m);
+    Lanes r = eval(n->sons[1], m);
+    switch (n->op) {
+        case Plus:
+            return l + r;
+        case Minus:
+            return l - r;
+        case Mult:
+            return l * r;
+        default: {
+            m &= alive;
+            Lanes zero = m & (r == 0);
+            if (any(zero)) {
+                for (unsigned i = 0; i < size; ++i) {
+                    if (zero[i]) fail(i, "integer division or modulo by zero");
+                }
+            }
+            // Lanes not running may hold anything, they divide by 1
+            r = m & (r != 0) ? r : splat(1);
+            return n->op == Div ? l / r : l % r;
+        }
+    }
+}
+
+Spmd::Lanes Spmd::test(const Node *n, Lanes m) {
+    switch (n->op) {
+        case And: {
+            Lanes a = test(n->sons[0], m);
+            return a & test(n->sons[1], m & a);
+        }
+        case Or: {
+            Lanes a = test(n->sons[0], m);
+            return a | test(n->sons[1], m & ~a);
+        }
+        case Negb:
+            return ~test(n->sons[0], m);
+    }
+    Lanes l = eval(n->sons[0], m);
+    Lanes r = eval(n->sons[1], m);
+    switch (n->op) {
+        case Lt:
+            return l < r;
+        case Gt:
+            return l > r;
+        default:
+            return l == r;
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef ZITP_SPMD_H
+#define ZITP_SPMD_H
+
+#include <deque>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Term.hpp"
+#include "value.hpp"
+#include "zitp.hpp"
+
+/*
+ * Lockstep execution of one program over many inputs, see --spmd.
+ *
+ * A program qualifies when it declares no function and every variable it
+ * names is typed Int. Its instances then run in groups of `lanes`, each
+ * variable holding one vector with a lane per instance, so every operator
+ * is a single vector operation for the whole group. A mask tells which
+ * lanes run a statement: If runs both branches under complementary masks,
+ * While loops until no lane is left in it, Return and errors take a lane
+ * out for good. Read and Print go through the lanes one by one.
+ *
+ * When a loop keeps running for only a few lanes of its group those lanes
+ * are dropped and later rerun from the start by the scalar interpreter, as
+ * are all instances of a program that does not qualify. Output is kept per
+ * instance until its run ends, so a dropped lane leaves nothing behind.
+ * As with --multiplex, every instance gets its output file: one printing
+ * nothing leaves a lone newline where a plain run creates no file.
+ */
+class Spmd {
+    public:
+    static const unsigned lanes = 32;
+    // One i32 per lane; GCC splits it into whatever vectors the target has
+    typedef i32 Lanes __attribute__((vector_size(lanes * sizeof(i32)), aligned(16)));
+
+    struct Node {
+        TermKind kind;
+        TermSubtype op;
+        i32 value = 0;                  // Number: the constant, names: the slot
+        Term *term = nullptr;           // Print, Return: the VarName printed
+        std::vector<const Node*> sons;
+        std::vector<i32> fresh;         // Declaration: slots it unassigns
+    };
+
+    // A loop running for fewer than lanes / sparse_ratio of its group for
+    // sparse_iterations iterations in a row drops those lanes
+    static const unsigned sparse_ratio = 4;
+    static const unsigned sparse_iterations = 64;
+
+    explicit Spmd(Term *ast);
+
+    // Engine of the scalar runs
+    void set_engine(Engine e) { engine = e; }
+
+    void add(const std::string& input, const std::string& output);
+
+    // Whether the program runs in lanes at all
+    bool vectorized() const { return body != nullptr; }
+
+    // Runs every instance to completion, returns how many of them failed
+    int run();
+
+    // Instances that ran in lanes, and that were dropped from them
+    usize in_lanes = 0, dropped = 0;
+
+    private:
+    // The lanes of a variable, and which of them were assigned
+    struct Var {
+        Lanes value, set;
+    };
+    struct Instance {
+        std::string input, output;
+        std::ifstream in;
+        std::string out, err;           // Printed so far, warnings so far
+        std::string error;              // What ended the run
+        bool printed = false, failed = false, dropped = false;
+    };
+
+    Term *ast;
+    Engine engine = QuickEngine;
+    const Node *body = nullptr;
+    std::deque<Node> nodes;
+    usize slots = 0;
+    std::vector<Instance> instances;
+
+    // The group running: its instances, variables and lanes still running
+    Instance *group = nullptr;
+    usize size = 0;
+    std::vector<Var> vars;
+    Lanes alive;
+
+    const Node* compile(Term *t, std::unordered_map<Term*, i32>& slots);
+    void run_group(usize first);
+    void run_scalar(usize index);
+
+    void exec(const Node *block, Lanes m);
+    void loop(const Node *st, Lanes m);
+    Lanes eval(const Node *n, Lanes m);
+    Lanes test(const Node *n, Lanes m);
+    void fail(unsigned lane, const std::string& msg);
+};
+
+#endif
@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <chrono>
+
+#include "stream.hpp"
+#include "closure.hpp"
+#include "types.hpp"
+
+// How long the runner waits for a whole batch once an item is queued: long
+// enough to parse a few items, short enough not to hold output back
+static const std::chrono::milliseconds batch_wait(1);
+
+ProgramStream::ProgramStream(const std::string& p, usize cap):
+    path(p), input(p), capacity(cap), batch_size(std::max<usize>(cap / 4, 1)),
+    top(new Term(Block)),
+    done(false), stopping(false), waiting(false)
+{
+    if (input) {
+        parser = std::thread(&ProgramStream::produce, this);
+    }
+}
+
+ProgramStream::~ProgramStream() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    if (parser.joinable()) parser.join();
+    for (auto item : items) delete item;
+    delete top;
+}
+
+// Blocks while the queue is full, false once the stream is stopped
+bool ProgramStream::push(Term *item) {
+    std::unique_lock<std::mutex> guard(lock);
+    ready.wait(guard, [this] { return stopping || items.size() < capacity; });
+    if (stopping) return false;
+    items.push_back(item);
+    // Wakes an idle runner on the first item so output is not held back,
+    // and again once a batch is complete
+    if (waiting && (items.size() == 1 || items.size() == batch_size)) ready.notify_all();
+    return true;
+}
+
+void ProgramStream::produce() {
+    try {
+        std::string token;
+        if (!(input >> token) || token != "Begin") {
+            throw RuntimeError(path + " does not start with Begin");
+        }
+        auto globals = global_scope();
+        // Holds the item being analysed, as convert_items() expects a block
+        Term pending(Block);
+        while (input >> token && token != "End") {
+            Term *item = parse(input, token, &pending);
+            if (item == nullptr || (item->kind != Command && item->kind != Function)) {
+                throw RuntimeError("Failed to parse " + path);
+            }
+            convert_items(&pending, globals);
+            infer_items(&pending);
+            pending.sons.clear();
+            item->father = top;
+            if (!push(item)) {
+                delete item;
+                break;
+            }
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> guard(lock);
+        error = std::current_exception();
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    done = true;
+    ready.notify_all();
+}
+
+bool ProgramStream::take(std::list<Term*>& batch) {
+    std::unique_lock<std::mutex> guard(lock);
+    // Waking per item costs more than running most items, so a batch is
+    // awaited for a little while once the first item is there
+    waiting = true;
+    ready.wait(guard, [this] { return done || !items.empty(); });
+    ready.wait_for(guard, batch_wait, [this] { return done || items.size() >= batch_size; });
+    waiting = false;
+    if (items.empty()) {
+        if (error) std::rethrow_exception(error);
+        return false;
+    }
+    bool full = items.size() >= capacity;
+    batch.insert(batch.end(), items.begin(), items.end());
+    items.clear();
+    if (full) ready.notify_all();
+    return true;
+}
+
+static bool defines_function(Term *t) {
+    if (t->kind == Function) return true;
+    for (auto son : t->sons) {
+        if (defines_function(son)) return true;
+    }
+    return false;
+}
+
+void ProgramStream::release(std::list<Term*>& batch, const std::function<void(Term*)>& ran) {
+    for (auto item : batch) {
+        bool functions = defines_function(item);
+        if (ran && !functions) ran(item);
+        if ((item->kind == Command && item->subtype == Declaration) || functions) {
+            top->sons.push_back(item);
+        } else {
+            delete item;
+        }
+    }
+    batch.clear();
+}
@@ -0,0 +1,62 @@
+#ifndef ZITP_STREAM_H
+#define ZITP_STREAM_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "Term.hpp"
+#include "value.hpp"
+
+/*
+ * Parses a program one top-level item at a time on its own thread.
+ *
+ * Each Function or Command of the top-level block is resolved and type
+ * checked as soon as it is complete, then queued for Zitp::run_stream(),
+ * which runs it while the rest of the program is still being parsed. At
+ * most `capacity` items are parsed ahead of the one running.
+ *
+ * Since later items are not known yet, globals are typed Dyn and global
+ * functions are assumed to escape, see convert_items() and infer_items().
+ */
+class ProgramStream {
+    std::string path;
+    std::ifstream input;
+    usize capacity;
+    usize batch_size;       // Items the runner waits for, see take()
+    // Items that must outlive their run: declarations later items resolve
+    // to, and the functions closures point into
+    Term *top;
+
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<Term*> items;
+    bool done, stopping, waiting;
+    std::exception_ptr error;
+    std::thread parser;
+
+    void produce();
+    bool push(Term *item);
+
+    public:
+    ProgramStream(const std::string& path, usize capacity = 64);
+    ~ProgramStream();
+
+    bool good() const { return input.good(); }
+
+    // Moves every item parsed so far into batch, waiting for at least one.
+    // Returns false at the end of the program, throws what parsing threw.
+    bool take(std::list<Term*>& batch);
+
+    // Frees the items of a batch that ran, except those that must be kept.
+    // Calls ran first with each item no closure points into.
+    void release(std::list<Term*>& batch, const std::function<void(Term*)>& ran = nullptr);
+};
+
+#endif
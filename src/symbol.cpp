@@ -0,0 +1,51 @@
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+#include "symbol.hpp"
+
+namespace {
+std::mutex lock;
+// A deque never moves its elements, so returned names stay valid
+std::deque<std::string> names(1);
+std::unordered_map<std::string, uint32_t> ids;
+// Ids never change, so each thread keeps those it saw without the lock
+thread_local std::unordered_map<std::string, uint32_t> seen;
+}
+
+uint32_t intern(const std::string& name) {
+    auto known = seen.find(name);
+    if (known != seen.end()) return known->second;
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = ids.find(name);
+    uint32_t id;
+    if (it != ids.end()) {
+        id = it->second;
+    } else {
+        id = names.size();
+        names.push_back(name);
+        ids.emplace(name, id);
+    }
+    seen.emplace(name, id);
+    return id;
+}
+
+uint32_t find_symbol(const std::string& name) {
+    auto known = seen.find(name);
+    if (known != seen.end()) return known->second;
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = ids.find(name);
+    if (it == ids.end()) return 0;
+    seen.emplace(name, it->second);
+    return it->second;
+}
+
+uint32_t symbol_count() {
+    std::lock_guard<std::mutex> guard(lock);
+    return names.size() - 1;
+}
+
+const std::string& symbol_name(uint32_t id) {
+    std::lock_guard<std::mutex> guard(lock);
+    return id < names.size() ? names[id] : names[0];
+}
@@ -0,0 +1,29 @@
+#ifndef ZITP_SYMBOL_H
+#define ZITP_SYMBOL_H
+
+#include <string>
+#include <cstdint>
+
+/*
+ * Global symbol table.
+ *
+ * Identifiers are interned once while parsing, after that terms and scopes
+ * only carry their 32 bit ids and compare them as integers. Id 0 is never
+ * handed out so tables can use it to mark an empty slot. Programs are parsed
+ * by several server workers at once, and bodies by several threads in
+ * parse_parallel(), so both calls take a lock; intern() only for names its
+ * thread has not seen yet. Names are never freed, a long running server
+ * bounds the table with symbol_count() instead.
+ */
+uint32_t intern(const std::string& name);
+
+// The id name was interned as, 0 if it never was; interns nothing
+uint32_t find_symbol(const std::string& name);
+
+// The identifier an id was interned from, for messages and printing
+const std::string& symbol_name(uint32_t id);
+
+// How many identifiers were interned so far
+uint32_t symbol_count();
+
+#endif
@@ -0,0 +1,288 @@
+#include <unordered_map>
+#include <unordered_set>
+
+#include "types.hpp"
+#include "value.hpp"
+
+namespace {
+
+StaticType join(StaticType a, StaticType b) {
+    if (a == b || b == NoType) return a;
+    if (a == NoType) return b;
+    return DynType;
+}
+
+bool falls_through(Term *block) {
+    if (block->sons.empty()) return true;
+    Term *last = block->sons.back();
+    if (last->kind != Command) return true;
+    if (last->subtype == Return) return false;
+    if (last->subtype == If && last->sons.size() == 3) {
+        auto it = ++last->sons.begin();
+        return falls_through(*it) || falls_through(*++it);
+    }
+    return true;
+}
+
+bool well_formed(Term *func) {
+    return func->sons.size() >= 2 && func->sons.back()->kind == Block;
+}
+
+class Inferrer {
+    // Functions by the declaration of their name, for names bound to a
+    // single function and never assigned anything else
+    std::unordered_map<Term*, Term*> known;
+    std::unordered_map<Term*, StaticType> returns;
+    bool changed;
+
+    void widen(Term *decl, StaticType t) {
+        if (!decl) return;
+        auto j = join(decl->type, t);
+        if (j != decl->type) {
+            decl->type = j;
+            changed = true;
+        }
+    }
+
+    void widen_return(Term *func, StaticType t) {
+        auto& ret = returns[func];
+        auto j = join(ret, t);
+        if (j != ret) {
+            ret = j;
+            changed = true;
+        }
+    }
+
+    Term *target(Term *name) {
+        auto it = known.find(name->decl);
+        return it == known.end() ? nullptr : it->second;
+    }
+
+    // Finds the functions and which of their names are ever rebound
+    void collect(Term *t, std::unordered_map<Term*, int>& bindings,
+                 std::vector<Term*>& functions) {
+        for (auto son : t->sons) {
+            if (son->kind == Function && well_formed(son)) {
+                functions.push_back(son);
+                ++bindings[son->sons.front()->decl];
+                // A function reusing a parameter's name may see the argument
+                auto last = --son->sons.end();
+                for (auto it = ++son->sons.begin(); it != last; ++it) {
+                    bindings[(*it)->decl] += 2;
+                }
+                if (auto lazy = (*last)->lazy.get()) {
+                    for (auto decl : lazy->writes) bindings[decl] += 2;
+                }
+            }
+            if (son->kind == Command && !son->sons.empty() &&
+                (son->subtype == Assign || son->subtype == Read)) {
+                bindings[son->sons.front()->decl] += 2;
+            }
+            collect(son, bindings, functions);
+        }
+    }
+
+    StaticType expr(Term *t) {
+        if (t->kind == BoolExpr) {
+            for (auto son : t->sons) expr(son);
+            return t->type = BoolType;
+        }
+        switch (t->subtype) {
+            case Number:
+                t->type = IntType;
+                break;
+            case VarName:
+                t->type = t->decl ? t->decl->type : DynType;
+                break;
+            case Apply:
+                t->type = call(t);
+                break;
+            default:
+                for (auto son : t->sons) expr(son);
+                t->type = IntType;
+        }
+        return t->type;
+    }
+
+    // The type a call returns. Arguments of a known function flow into
+    // its parameters.
+    StaticType call(Term *t) {
+        auto it = t->sons.begin();
+        Term *func = target(*it++);
+        if (!func) {
+            for (; it != t->sons.end(); ++it) expr(*it);
+            return DynType;
+        }
+        auto param = ++func->sons.begin(), last = --func->sons.end();
+        for (; it != t->sons.end(); ++it) {
+            auto ty = expr(*it);
+            if (param != last) widen((*param++)->decl, ty);
+        }
+        return returns[func];
+    }
+
+    void function(Term *func) {
+        if (!well_formed(func)) return;
+        widen(func->sons.front()->decl, FuncType);
+        if (auto lazy = func->sons.back()->lazy.get()) {
+            // Typed once parsed, see run_body()
+            for (auto decl : lazy->writes) widen(decl, DynType);
+            widen_return(func, DynType);
+            return;
+        }
+        body(func->sons.back(), func);
+        if (falls_through(func->sons.back())) {
+            widen_return(func, IntType);
+        }
+    }
+
+    void body(Term *t, Term *func) {
+        for (auto cmd : t->sons) {
+            if (cmd->kind == Function) {
+                function(cmd);
+                continue;
+            }
+            if (cmd->kind != Command || cmd->sons.empty()) continue;
+            switch (cmd->subtype) {
+                case Assign:
+                    if (cmd->sons.size() == 2) {
+                        widen(cmd->sons.front()->decl, expr(cmd->sons.back()));
+                    }
+                    break;
+                case Read:
+                    widen(cmd->sons.front()->decl, IntType);
+                    break;
+                case Call:
+                    call(cmd);
+                    break;
+                case Print:
+                    expr(cmd->sons.front());
+                    break;
+                case Return: {
+                    auto ty = expr(cmd->sons.front());
+                    if (func) widen_return(func, ty);
+                    break;
+                }
+                case If:
+                case While:
+                    for (auto son : cmd->sons) {
+                        if (son->kind == Block) body(son, func);
+                        else expr(son);
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    static void expect_int(Term *t) {
+        if (t->type != FuncType) return;
+        throw RuntimeError("Type error: "
+            + (t->subtype == VarName ? t->name() : "expression")
+            + " is a function, expected an integer");
+    }
+
+    void check_call(Term *t) {
+        Term *name = t->sons.front();
+        if (name->decl && name->decl->type == IntType) {
+            throw RuntimeError("Type error: " + name->name() + " is not a function");
+        }
+        Term *func = target(name);
+        if (func && func->sons.size() != t->sons.size() + 1) {
+            throw RuntimeError("Type error: " + name->name() + " takes "
+                               + std::to_string(func->sons.size() - 2) + " arguments, got "
+                               + std::to_string(t->sons.size() - 1));
+        }
+    }
+
+    void check(Term *t) {
+        if (t->kind == Expr && t->subtype >= Plus && t->subtype <= Mod) {
+            for (auto son : t->sons) expect_int(son);
+        }
+        if (t->kind == BoolExpr && t->subtype >= Lt && t->subtype <= Eq) {
+            for (auto son : t->sons) expect_int(son);
+        }
+        if ((t->kind == Expr && t->subtype == Apply) ||
+            (t->kind == Command && t->subtype == Call)) {
+            check_call(t);
+        }
+        for (auto son : t->sons) check(son);
+    }
+
+    void solve(Term *block, Term *func, bool open_globals = false) {
+        std::unordered_map<Term*, int> bindings;
+        std::vector<Term*> functions;
+        collect(block, bindings, functions);
+        if (open_globals) {
+            // Globals declared here may be assigned anything by later items
+            for (auto cmd : block->sons) {
+                if (cmd->kind == Function && well_formed(cmd)) {
+                    auto decl = cmd->sons.front()->decl;
+                    bindings[decl] += 2;
+                    widen(decl, DynType);
+                } else if (cmd->kind == Command && cmd->subtype == Declaration) {
+                    for (auto var : cmd->sons) widen(var->decl, DynType);
+                }
+            }
+        }
+        for (auto f : functions) {
+            auto decl = f->sons.front()->decl;
+            if (bindings[decl] == 1) known[decl] = f;
+        }
+        // Anything may be passed to a function called through a value,
+        // or from a body not parsed yet
+        std::unordered_set<Term*> open;
+        for (auto f : functions) {
+            if (auto lazy = f->sons.back()->lazy.get()) {
+                open.insert(f);
+                for (auto decl : lazy->reads) {
+                    auto it = known.find(decl);
+                    if (it != known.end()) open.insert(it->second);
+                }
+            }
+        }
+        for (auto f : functions) {
+            if (target(f->sons.front()) == f && !f->escapes && !open.count(f)) continue;
+            auto last = --f->sons.end();
+            for (auto it = ++f->sons.begin(); it != last; ++it) {
+                widen((*it)->decl, DynType);
+            }
+        }
+
+        do {
+            changed = false;
+            body(block, func);
+        } while (changed);
+        check(block);
+    }
+
+    public:
+    void run(Term *program) {
+        solve(program, nullptr);
+    }
+
+    void run_items(Term *block) {
+        solve(block, nullptr, true);
+    }
+
+    // Functions outside the body are not known, so nothing flows back out
+    void run_body(Term *func) {
+        solve(func->sons.back(), func);
+    }
+};
+
+}
+
+void infer_types(Term *program) {
+    if (!program || program->kind != Block) return;
+    Inferrer().run(program);
+}
+
+void infer_body(Term *func) {
+    Inferrer().run_body(func);
+}
+
+void infer_items(Term *block) {
+    Inferrer().run_items(block);
+}
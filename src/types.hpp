@@ -0,0 +1,28 @@
+#ifndef ZITP_TYPES_H
+#define ZITP_TYPES_H
+
+#include "Term.hpp"
+
+/*
+ * Type inference over the resolved program, run after convert_closures().
+ *
+ * Every declaration gets the join of whatever is assigned to it, read into
+ * it or passed to it, and every expression the type it evaluates to. A name
+ * bound to a single function and never reassigned is called directly, so
+ * its arguments flow into its parameters and its returns into the call.
+ * Parameters of functions that may be called through a value are Dyn.
+ *
+ * Only definite errors are rejected: arithmetic or comparisons on a
+ * function, calling an integer, and calling a known function with the
+ * wrong number of arguments. Throws RuntimeError for those.
+ *
+ * A body parse_lazy() skipped returns Dyn and makes whatever it may assign
+ * Dyn; infer_body() types it once parsed.
+ */
+void infer_types(Term *program);
+void infer_body(Term *func);
+// Top-level items on their own, see convert_items(). Globals are Dyn and
+// global functions are never known.
+void infer_items(Term *block);
+
+#endif
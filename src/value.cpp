@@ -1,108 +1,169 @@
 #include "value.hpp"
+#include "symbol.hpp"
 
 using std::cout;
 using std::cerr;
 using std::endl;
 using std::string;
-using std::shared_ptr;
 
 #ifndef DEBUG_MODE
 #define DEBUG_MODE 0
 #endif
 
+thread_local usize heap_bytes = 0, heap_limit = SIZE_MAX;
+
+void out_of_memory() {
+    throw LimitError(MemoryLimit, "Memory limit exceeded");
+}
+
 #if DEBUG_MODE
 static u32 sid = 0;
 #endif
 Scope::Scope(Scope *s, usize seen) :
-    ref(1), top(false), outer(s), visible(seen)
+    outer(s), visible(seen)
 {
+    refs = 1;
     #if DEBUG_MODE
     id = sid++;
+    if (s) cout << "Scope " << id << " in Scope " << s->id << endl;
     #endif
-    if (s) {
-        #if DEBUG_MODE
-        cout << "Scope " << id << " link Scope " << s->id << endl;
-        #endif
-        s->link();
-    }
 }
 
-void Scope::decl_var(const string& name) {
-    static auto dummy = std::make_shared<Value>();
-    for (auto &search : map) {
-        if (search.first == name) return;
+Scope::~Scope() {
+    // Functions in here may still look at this scope while dying
+    map.clear();
+    heap_bytes -= map.capacity() * slot_bytes + index.capacity() * sizeof(Entry) +
+                  (heap ? sizeof(Scope) : 0);
+    #if DEBUG_MODE
+    if (refs > 1) {
+        cerr << "Scope " << id << ": Why refs > 1?" << endl;
     }
-    map.push_back(std::make_pair(name, dummy));
+    std::cout << "Destroying scope " << id << std::endl;
+    #endif
 }
 
-std::vector<var_t>::iterator Scope::find_var(Scope *root, const std::string& key) const {
-    usize before = root->map.size();
-    while (root) {
-        auto it = root->map.begin();
-        auto cnt = std::min(before, root->map.size());
-        while (cnt != 0) {
-            if (it->first == key) {
-                return it;
-            }
-            ++it; --cnt;
-        }
-        before = root->visible;
-        root = root->outer;
-    }
-    cerr << "ERROR: Cannot find " << key << endl;
-    std::exit(1);
+Ref<Scope> Scope::make_env(Scope *s, usize seen) {
+    if (heap_bytes + sizeof(Scope) > heap_limit) out_of_memory();
+    heap_bytes += sizeof(Scope);
+    Scope *env = new Scope(s, seen);
+    env->refs = 0;
+    env->heap = true;
+    return Ref<Scope>(env);
+}
+
+// Below this many variables comparing every id beats hashing
+static const usize linear_limit = 8;
+
+static inline usize hash_sym(u32 sym) {
+    u32 h = sym * 0x9E3779B1u;
+    return h ^ (h >> 16);
+}
+
+void Scope::grown(usize vars, usize entries) {
+    usize n = (map.capacity() - vars) * slot_bytes + (index.capacity() - entries) * sizeof(Entry);
+    heap_bytes += n;
+    if (heap_bytes > heap_limit) out_of_memory();
 }
 
-shared_ptr<Value> Scope::get_val(const string &key) {
-    auto it = find_var(this, key);
-    return it->second;
+void Scope::push(u32 sym, Ref<Value> slot) {
+    usize vars = map.capacity();
+    map.emplace_back(sym, std::move(slot));
+    if (map.capacity() != vars) grown(vars, index.capacity());
+    if (map.size() <= linear_limit) return;
+    if (index.size() < map.size() * 2) {
+        usize entries = index.capacity();
+        // Keep the table at most half full
+        index.assign(std::max(index.size() * 2, linear_limit * 4), Entry{0, 0});
+        for (u32 pos = 0; pos + 1 < map.size(); ++pos) {
+            auto i = hash_sym(map[pos].first) & (index.size() - 1);
+            while (index[i].sym) i = (i + 1) & (index.size() - 1);
+            index[i] = Entry{map[pos].first, pos};
+        }
+        grown(map.capacity(), entries);
+    }
+    auto i = hash_sym(sym) & (index.size() - 1);
+    while (index[i].sym) i = (i + 1) & (index.size() - 1);
+    index[i] = Entry{sym, (u32)map.size() - 1};
 }
 
-void Scope::set_var(const string& key, shared_ptr<Value> v) {
-    auto it = find_var(this, key);
-    if (it->second->kind == Func) {
-        auto fv = std::static_pointer_cast<FuncValue>(it->second);
-        if (--fv->ref == 0) {
-            auto captured = fv->outer;
-            // Reclaim unused scope
-            if (captured != this) captured->free2top();
+// The variable if it is among the first `before` ones of this scope.
+// A name is declared at most once per scope so the first hit decides.
+var_t* Scope::lookup(u32 sym, usize before) {
+    if (index.empty()) {
+        auto n = std::min(before, map.size());
+        for (usize i = 0; i < n; ++i) {
+            if (map[i].first == sym) return &map[i];
         }
+        return nullptr;
     }
-    it->second = v;
-    if (v->kind == Func) {
-        auto fv = std::static_pointer_cast<FuncValue>(v);
-        ++fv->ref;
+    usize mask = index.size() - 1;
+    for (auto i = hash_sym(sym) & mask; index[i].sym; i = (i + 1) & mask) {
+        if (index[i].sym == sym) {
+            return index[i].pos < before ? &map[index[i].pos] : nullptr;
+        }
     }
+    return nullptr;
 }
 
-void Scope::free2top() {
-    // Ignore Program Block
-    if (!outer) return;
+// Value of unassigned variables, per thread since counts are not atomic
+static thread_local Ref<Value> dummy(new NullValue());
 
-    --outer->ref;
-    if (top) {
-        return destroy();
+void Scope::decl_var(u32 sym, bool boxed) {
+    if (lookup(sym, map.size())) return;
+    if (boxed) {
+        push(sym, make_ref<BoxValue>(dummy));
+    } else {
+        push(sym, dummy);
     }
-    auto prev = outer;
-    destroy();
-    prev->free2top();
-}
-
-void Scope::unlink() {
-    if (ref == 0) {
-        #if DEBUG_MODE
-        cerr << "Scope " << id << ": ";
-        #endif
-        cerr << "Why ref == 0?" << endl;
-        return;
+}
+
+void Scope::renew_var(u32 sym) {
+    if (auto var = lookup(sym, map.size())) {
+        var->second = dummy;
+    } else {
+        push(sym, dummy);
     }
-    if (--ref == 0) {
-        if (outer) {
-            #if DEBUG_MODE
-            cout << "Scope " << id << " unlink Scope " << outer->id << endl;
-            #endif
-            outer->unlink();
+}
+
+var_t& Scope::find_var(u32 key) {
+    Scope *root = this;
+    usize before = map.size();
+    while (root) {
+        if (auto var = root->lookup(key, before)) {
+            return *var;
         }
-        return destroy();
+        before = root->visible;
+        root = root->outer;
+    }
+    throw RuntimeError("Cannot find " + symbol_name(key));
+}
+
+Ref<Value>& Scope::var(u32 key) {
+    auto& slot = find_var(key);
+    if (slot.second->kind == Box) {
+        return static_cast<BoxValue*>(slot.second.get())->val;
+    }
+    return slot.second;
+}
+
+const Ref<Value>& Scope::get_val(u32 key) {
+    return var(key);
+}
+
+const Ref<Value>& Scope::get_slot(u32 key) {
+    return find_var(key).second;
+}
+
+void Scope::set_var(u32 key, Ref<Value> v) {
+    var(key) = std::move(v);
+}
+
+Scope* Scope::global_view(usize& seen) {
+    Scope *root = this;
+    seen = map.size();
+    while (root->outer) {
+        seen = root->visible;
+        root = root->outer;
     }
+    return root;
 }
@@ -10,6 +10,7 @@
 #include <vector>
 #include <functional>
 #include <unordered_map>
+#include <stdexcept>
 
 #include "Term.hpp"
 
@@ -19,16 +20,135 @@
 
 typedef int32_t i32;
 typedef uint32_t u32;
+typedef uint64_t u64;
 typedef uintptr_t usize;
 
+// Thrown on errors while running a program. The CLI reports it and
+// exits, while the server only fails the current request.
+class RuntimeError : public std::runtime_error {
+    public:
+    RuntimeError(const std::string& msg): std::runtime_error(msg) {}
+};
+
+// Limits of a run, 0 for none. Going over one ends the run with a
+// LimitError; the parallel evaluator does not count, so it is not used
+// under a fuel or depth limit.
+struct Budget {
+    u64 fuel = 0;       // Calls and loop iterations
+    u32 depth = 0;      // Calls running at once
+    usize memory = 0;   // Bytes of values and scope storage, see heap_bytes
+};
+
+enum Limit { FuelLimit, DepthLimit, MemoryLimit };
+
+// Thrown when a run goes over its Budget
+class LimitError : public RuntimeError {
+    public:
+    Limit limit;
+    LimitError(Limit l, const std::string& msg): RuntimeError(msg), limit(l) {}
+    // Of the CLI, 3 to 5 in the order of Limit
+    int exit_code() const { return 3 + limit; }
+};
+
+// Bytes of values and scope storage alive on this thread, and how many
+// there may be before allocating more throws a LimitError. Integers and
+// booleans come and go too often to count, each variable slot is charged
+// for one instead. Only growing a scope or making a closure environment
+// adds places to hold more values, so only those check the limit.
+extern thread_local usize heap_bytes, heap_limit;
+[[noreturn]] void out_of_memory();
+
+// Bounds heap_bytes to limit more than now while alive, 0 for no bound
+class HeapLimit {
+    usize saved;
+    public:
+    explicit HeapLimit(usize limit): saved(heap_limit) {
+        if (limit) heap_limit = heap_bytes + limit;
+    }
+    ~HeapLimit() { heap_limit = saved; }
+};
+
+// Base of everything handled through Ref. Each interpreter runs on one
+// thread and never shares its values, so the count is a plain integer.
+class Counted {
+    public:
+    u32 refs = 0;
+};
+
+// Intrusive handle, deletes the object when the last handle goes away.
+// Moving a handle hands its count over without touching it.
+template <class T>
+class Ref {
+    T *p;
+    public:
+    Ref(): p(nullptr) {}
+    Ref(std::nullptr_t): p(nullptr) {}
+    Ref(T *t): p(t) { if (p) ++p->refs; }
+    Ref(const Ref& r): p(r.p) { if (p) ++p->refs; }
+    Ref(Ref&& r): p(r.p) { r.p = nullptr; }
+    template <class U>
+    Ref(const Ref<U>& r): p(r.get()) { if (p) ++p->refs; }
+    template <class U>
+    Ref(Ref<U>&& r): p(r.release()) {}
+    ~Ref() {
+        if (p && --p->refs == 0) delete p;
+    }
+
+    Ref& operator=(Ref r) {
+        std::swap(p, r.p);
+        return *this;
+    }
+
+    T* get() const { return p; }
+    T* operator->() const { return p; }
+    T& operator*() const { return *p; }
+    explicit operator bool() const { return p != nullptr; }
+    // Gives up the object without dropping its count
+    T* release() {
+        T *t = p;
+        p = nullptr;
+        return t;
+    }
+};
+
+template <class T, class... Args>
+Ref<T> make_ref(Args&&... args) {
+    return Ref<T>(new T(std::forward<Args>(args)...));
+}
+
+// Objects a heap census can find, on a list per thread from the newest
+template <class T>
+class Tracked {
+    T *prev = nullptr, *next;
+    void link() {
+        next = live;
+        if (next) next->Tracked::prev = static_cast<T*>(this);
+        live = static_cast<T*>(this);
+    }
+    public:
+    static thread_local T *live;
+    Tracked() { link(); }
+    Tracked(const Tracked&) { link(); }
+    ~Tracked() {
+        if (prev) prev->Tracked::next = next;
+        else live = next;
+        if (next) next->Tracked::prev = prev;
+    }
+    T* next_live() const { return next; }
+};
+
+template <class T>
+thread_local T *Tracked<T>::live = nullptr;
+
 enum ValueKind {
     Null,
     Boolean,
     Integer,
-    Func
+    Func,
+    Box
 };
 
-class Value {
+class Value : public Counted {
     public:
     Value(): kind(Null) {}
     virtual ~Value() {}
@@ -42,6 +162,17 @@ class IntValue : public Value {
         kind = Integer;
     }
     i32 value() const { return val; }
+    // Only for values held by a single variable, see Compiled
+    void set(i32 v) { val = v; }
+};
+
+// Value of variables never assigned. Shaped like an IntValue holding 0 so
+// the typed integer paths may read it without checking the kind.
+class NullValue : public IntValue {
+    public:
+    NullValue() {
+        kind = Null;
+    }
 };
 
 class BoolValue : public Value {
@@ -53,49 +184,97 @@ class BoolValue : public Value {
     bool value() const { return val; }
 };
 
-typedef std::pair<std::string, std::shared_ptr<Value>> var_t;
-class Scope {
+// Slot shared by a scope and the closures capturing one of its variables,
+// used only for variables that are both captured and assigned.
+class BoxValue : public Value {
+    public:
+    Ref<Value> val;
+    BoxValue(Ref<Value> v): val(std::move(v)) {
+        kind = Box;
+        heap_bytes += sizeof(BoxValue);
+    }
+    ~BoxValue() { heap_bytes -= sizeof(BoxValue); }
+};
+
+typedef std::pair<u32, Ref<Value>> var_t;
+class Scope : public Counted, public Tracked<Scope> {
     private:
-        u32 ref;
-        bool top;
-        std::vector<var_t>::iterator find_var(Scope *root, const std::string& key) const;
-        void destroy() {
-            #if DEBUG_MODE
-            std::cout << "Destroying scope " << id << std::endl;
-            #endif
-            delete this;
-        }
+        // Open addressing table from symbol to position in map, only built
+        // once the scope is too big for a linear scan to win
+        struct Entry { u32 sym; u32 pos; };
+        std::vector<Entry> index;
+        void push(u32 sym, Ref<Value> slot);
+        // Counts storage that grew from the given capacities
+        void grown(usize vars, usize entries);
+        static const usize slot_bytes = sizeof(var_t) + sizeof(IntValue);
+        var_t* lookup(u32 sym, usize before);
+        var_t& find_var(u32 key);
 
     public:
         Scope* outer;
         usize visible;
+        bool heap = false;      // A closure environment from make_env()
         #if DEBUG_MODE
         u32 id;
         #endif
         std::vector<var_t> map;
+
+        // Block and call scopes live on the interpreter stack and die with
+        // their block. Their block holds one count so handles taken by the
+        // functions defined there never free them.
         Scope(Scope *s, usize seen);
+        ~Scope();
+        // Environment of an escaping closure, freed with its last handle
+        static Ref<Scope> make_env(Scope *s, usize seen);
 
-        void mark_top() { top = true; }
-        void link() { ++ref; }
         usize count_vars() const { return map.size(); }
-        void unlink();
-        void free2top();
-        void decl_var(const std::string& name);
-        void set_var(const std::string& key, std::shared_ptr<Value> v);
-        std::shared_ptr<Value> get_val(const std::string &key);
+        void reserve(usize vars) {
+            usize before = map.capacity();
+            map.reserve(vars);
+            grown(before, index.capacity());
+        }
+        void decl_var(u32 sym, bool boxed = false);
+        // Declares sym, or sets it back to Null when this scope has it,
+        // for the variables of flat blocks, see convert_closures()
+        void renew_var(u32 sym);
+        void set_var(u32 key, Ref<Value> v);
+        const Ref<Value>& get_val(u32 key);
+
+        // The variable itself, through its box, to update it in place
+        Ref<Value>& var(u32 key);
+
+        // The slot itself, which is the BoxValue for boxed variables
+        const Ref<Value>& get_slot(u32 key);
+        void capture(u32 sym, Ref<Value> slot) {
+            push(sym, std::move(slot));
+        }
+        // The global scope and how many of its variables are visible here
+        Scope* global_view(usize& seen);
+        // Bytes held by the scope itself
+        usize bytes() const {
+            return sizeof(Scope) + map.capacity() * sizeof(var_t) + index.capacity() * sizeof(Entry);
+        }
 };
 
-class FuncValue : public Value {
+struct Code;
+
+class FuncValue : public Value, public Tracked<FuncValue> {
     Term* val;
     public:
-    Scope* outer;
+    // Compiled body when created by the closure compiled engine
+    const Code *code = nullptr;
+    // For escaping functions either the flat scope holding the captured
+    // variables, whose outer is the global scope, or the global scope itself
+    // when nothing is captured. Otherwise the scope defining the function.
+    Ref<Scope> outer;
     usize visible;
-    usize ref;
-    FuncValue(Scope *s, Term* v = nullptr) :
-        val(v), outer(s), visible(s->count_vars()), ref(1)
+    FuncValue(Ref<Scope> s, usize seen, Term* v = nullptr) :
+        val(v), outer(std::move(s)), visible(seen)
     {
         kind = Func;
+        heap_bytes += sizeof(FuncValue);
     }
+    ~FuncValue() { heap_bytes -= sizeof(FuncValue); }
     Term* value() const { return val; }
 };
 
@@ -1,133 +1,158 @@
 #include "zitp.hpp"
+#include "quicken.hpp"
+#include "compile.hpp"
+#include "stream.hpp"
+#include "server.hpp"
 
 using std::cout;
 using std::cerr;
 using std::endl;
 using std::string;
-using std::shared_ptr;
 using std::ifstream;
 using std::ofstream;
 
 typedef int32_t i32;
 typedef uint32_t u32;
 
-static shared_ptr<BoolValue> _bools[2] = {
-    std::make_shared<BoolValue>(false),
-    std::make_shared<BoolValue>(true),
-};
+#define to_int(v)  (static_cast<const IntValue*>((v).get())->value())
+#define to_bool(v) (static_cast<const BoolValue*>((v).get())->value())
+#define to_func(v) (static_cast<const FuncValue*>((v).get())->value())
 
-#define to_int(v)  (std::static_pointer_cast<const IntValue>(v)->value())
-#define to_bool(v) (std::static_pointer_cast<const BoolValue>(v)->value())
-#define to_func(v) (std::static_pointer_cast<const FuncValue>(v)->value())
+#define is_boxed(name) ((name)->decl && (name)->decl->boxed)
 
-#define make_int(v)  (std::make_shared<IntValue>(v))
-#define make_bool(v)  ((v) ? _bools[1] : _bools[0])
+#define make_int(v)  (make_ref<IntValue>(v))
+#define make_bool(v)  ((v) ? bools[1] : bools[0])
 
-shared_ptr<Value> Zitp::eval_expr(Term *t, Scope *current) {
+// The function a Call or Apply refers to
+static const FuncValue* callee(const Ref<Value>& var, Term *call) {
+    if (!var || var->kind != Func) {
+        throw RuntimeError(call->sons.front()->name() + " is not a function");
+    }
+    return static_cast<const FuncValue*>(var.get());
+}
+
+// Operands typed Dyn may hold anything at run time
+i32 Zitp::checked_int(const Ref<Value>& v, Term *t) {
+    if (!v || (v->kind != Integer && v->kind != Null)) {
+        throw RuntimeError((t->subtype == VarName ? t->name() : "expression")
+                           + " is not an integer");
+    }
+    return to_int(v);
+}
 
-    shared_ptr<Value> l, r;
+i32 Zitp::eval_int(Term *t, Scope *current) {
+    if (t->eval) {
+        return t->eval(*this, t, current);
+    }
+    if (engine == QuickEngine && ++t->hits == Quick::threshold) {
+        Quick::specialize(t, current);
+        if (t->eval) return t->eval(*this, t, current);
+    }
+    i32 l, r;
+    switch (t->subtype) {
+        case Number:
+            return t->number;
+        case VarName: {
+            const auto& var = current->get_val(t->sym);
+            return t->type == DynType ? checked_int(var, t) : to_int(var);
+        }
+        case Plus:
+            l = eval_int(t->sons.front(), current);
+            return l + eval_int(t->sons.back(), current);
+        case Minus:
+            l = eval_int(t->sons.front(), current);
+            return l - eval_int(t->sons.back(), current);
+        case Mult:
+            l = eval_int(t->sons.front(), current);
+            return l * eval_int(t->sons.back(), current);
+        case Div:
+        case Mod:
+            l = eval_int(t->sons.front(), current);
+            r = eval_int(t->sons.back(), current);
+            if (r == 0) {
+                throw RuntimeError("integer division or modulo by zero");
+            }
+            return t->subtype == Div ? l / r : l % r;
+        default:
+            // Calls still return boxed values
+            return checked_int(eval_expr(t, current), t);
+    }
+}
+
+bool Zitp::eval_bool(Term *t, Scope *current) {
     auto first = t->sons.front();
     auto last = t->sons.back();
-    shared_ptr<Value> var;
+    i32 l;
+    switch (t->subtype) {
+        case Lt:
+            l = eval_int(first, current);
+            return l < eval_int(last, current);
+        case Gt:
+            l = eval_int(first, current);
+            return l > eval_int(last, current);
+        case Eq:
+            l = eval_int(first, current);
+            return l == eval_int(last, current);
+        case And:
+            return eval_bool(first, current) && eval_bool(last, current);
+        case Or:
+            return eval_bool(first, current) || eval_bool(last, current);
+        case Negb:
+            return !eval_bool(first, current);
+        default:
+            throw RuntimeError("Invalid bool expr: " + std::to_string(t->subtype));
+    }
+}
+
+Ref<Value> Zitp::eval_expr(Term *t, Scope *current) {
+
+    auto first = t->sons.front();
+    Ref<Value> var;
     if (t->kind == BoolExpr) {
-        switch (t->subtype) {
-            case Lt:
-                l = eval_expr(first, current);
-                r = eval_expr(last, current);
-                return make_bool(to_int(l) < to_int(r));
-            case Gt:
-                l = eval_expr(first, current);
-                r = eval_expr(last, current);
-                return make_bool(to_int(l) > to_int(r));
-            case Eq:
-                l = eval_expr(first, current);
-                r = eval_expr(last, current);
-                return make_bool(to_int(l) == to_int(r));
-            case And:
-                l = eval_expr(first, current);
-                if (!to_bool(l)) {
-                    return make_bool(false);
-                }
-                r = eval_expr(last, current);
-                return make_bool(to_bool(r));
-            case Or:
-                l = eval_expr(first, current);
-                if (to_bool(l)) {
-                    return make_bool(true);
-                }
-                r = eval_expr(last, current);
-                return make_bool(to_bool(r));
-            case Negb:
-                l = eval_expr(first, current);
-                return make_bool(!to_bool(l));
-        }
+        return make_bool(eval_bool(t, current));
     }
     else if (t->kind == Expr) {
         switch (t->subtype) {
             case Number:
                 return make_int(t->number);
             case VarName:
-                var = current->get_val(t->name);
+                var = current->get_val(t->sym);
                 if (!var) return var;
-                //cout << "Var " << t->name << ": " << to_int(var.get()) << endl;
+                //cout << "Var " << t->name() << ": " << to_int(var.get()) << endl;
                 if (var->kind != Null) return var;
-                cerr << "ERROR: Invalid kind of var: " << t->name <<endl;
+                cerr << "ERROR: Invalid kind of var: " << t->name() <<endl;
                 return var;
             case Plus:
-                l = eval_expr(first, current);
-                r = eval_expr(last, current);
-                return make_int(to_int(l) + to_int(r));
             case Minus:
-                l = eval_expr(first, current);
-                r = eval_expr(last, current);
-                return make_int(to_int(l) - to_int(r));
             case Mult:
-                l = eval_expr(first, current);
-                r = eval_expr(last, current);
-                return make_int(to_int(l) * to_int(r));
             case Div:
-                l = eval_expr(first, current);
-                r = eval_expr(last, current);
-                if (to_int(r) == 0) {
-                    cerr << "ERROR: integer division or modulo by zero" << endl;
-                    std::exit(1);
-                }
-                return make_int(to_int(l) / to_int(r));
             case Mod:
-                l = eval_expr(first, current);
-                r = eval_expr(last, current);
-                if (to_int(r) == 0) {
-                    cerr << "ERROR: integer division or modulo by zero" << endl;
-                    std::exit(1);
-                }
-                return make_int(to_int(l) % to_int(r));
+                return make_int(eval_int(t, current));
             case Apply: {
-                var = current->get_val(first->name);
-                const FuncValue *fv = static_cast<const FuncValue*>(var.get());
-                Scope *s = new Scope(fv->outer, fv->visible);
-                s->mark_top();
-                #if DEBUG_MODE
-                cout << "Apply <" << first->name << "> scope: " << s->id <<endl;
-                #endif
-                init_params(fv, t, s, current);
+                var = current->get_val(first->sym);
+                auto fv = callee(var, t);
+                CallDepth guard(*this);
+                Scope s(fv->outer.get(), fv->visible);
+                enter_call(var, t, &s, current);
                 Term *func = fv->value();
-                auto res = execute_program(func->sons.back(), s);
-                return res;
+                if (func->observed) {
+                    return observe_call(func, &s, [&] { return execute_program(func->sons.back(), &s); });
+                }
+                return execute_program(func->sons.back(), &s);
             }
         }
     }
-    cerr << "ERROR: Invalid expr: " << t->kind << endl;
-    std::exit(1);
+    throw RuntimeError("Invalid expr: " + std::to_string(t->kind));
 }
 
 void Zitp::init_params(const FuncValue *fv, Term *argus, Scope *born, Scope *current) {
     Term *params = fv->value();
     // Function has a Block
     if (params->sons.size() - 1 != argus->sons.size()) {
-        cerr << "ERROR: Different size:" << endl;
-        cerr << "vars size: " << params->sons.size() - 1 << endl;
-        cerr << "exprs size: " << argus->sons.size() << endl;
-        std::exit(1);
+        throw RuntimeError("Different size: vars size: "
+                           + std::to_string(params->sons.size() - 1)
+                           + ", exprs size: "
+                           + std::to_string(argus->sons.size()));
     }
     auto vit = ++params->sons.begin();
     auto eit = ++argus->sons.begin();
@@ -135,139 +160,161 @@ void Zitp::init_params(const FuncValue *fv, Term *argus, Scope *born, Scope *cur
          i > 1;
          --i, ++vit, ++eit)
     {
-        born->decl_var((*vit)->name);
-        born->set_var((*vit)->name, eval_expr(*eit, current));
+        born->decl_var((*vit)->sym, is_boxed(*vit));
+        born->set_var((*vit)->sym, eval_expr(*eit, current));
     }
 }
 
-static void free_scope(const Value* ret, Scope *root) {
-    if (ret && ret->kind == Func) {
-        auto fv = static_cast<const FuncValue*>(ret);
-        if (fv->outer != root) {
-            root->unlink();
-        }
-        return;
+// Binds the arguments in the scope the call runs in
+void Zitp::enter_call(const Ref<Value>& var, Term *call, Scope *s, Scope *current) {
+    const FuncValue *fv = static_cast<const FuncValue*>(var.get());
+    #if DEBUG_MODE
+    cout << (call->subtype == Apply ? "Apply <" : "Call <")
+         << call->sons.front()->name() << "> scope: " << s->id <<endl;
+    #endif
+    tick();
+    Term *func = fv->value();
+    if (func->sons.back()->lazy) {
+        load_body(func);
+    }
+    if (func->frame) {
+        s->reserve(func->frame);
     }
+    if (func->selfref) {
+        // Bound per call since capturing itself would be a cycle
+        u32 self = func->sons.front()->sym;
+        s->decl_var(self);
+        s->set_var(self, var);
+    }
+    init_params(fv, call, s, current);
+}
 
-    for (auto& e : root->map) {
-        if (e.second->kind == Func) {
-            auto fv = std::static_pointer_cast<FuncValue>(e.second);
-            if (--fv->ref == 0) {
-                auto captured = fv->outer;
-                if (captured != root) {
-                    captured->free2top();
-                    continue;
-                }
-            }
-            e.second.reset();
-        }
+Ref<Value> Zitp::make_closure(Term *func, Scope *root) {
+    if (!func->escapes) {
+        // The frame stack holds its count and pops it when root's block ends
+        frames.emplace_back(root, root->count_vars(), func);
+        frames.back().refs = 1;
+        return Ref<Value>(&frames.back());
+    }
+
+    usize visible;
+    Scope *globals = root->global_view(visible);
+    if (func->captures.empty()) {
+        return make_ref<FuncValue>(globals, visible, func);
     }
-    return root->unlink();
+    auto env = Scope::make_env(globals, visible);
+    #if DEBUG_MODE
+    cout << "Closure <" << func->sons.front()->name() << "> scope: " << env->id << endl;
+    #endif
+    for (auto decl : func->captures) {
+        env->capture(decl->sym, root->get_slot(decl->sym));
+    }
+    return make_ref<FuncValue>(env, env->count_vars(), func);
 }
 
-shared_ptr<Value> Zitp::execute_program(Term *t, Scope *root) {
+Ref<Value> Zitp::execute_program(Term *t, Scope *root, usize from) {
     if (t->kind != Block) {
-        cerr << "ERROR: Not a Block" << endl;
-        std::exit(1);
+        throw RuntimeError("Not a Block");
     }
+    FrameMark mark(frames, root);
 
-    for (auto &cmd : t->sons) {
+    for (auto it = std::next(t->sons.begin(), from); it != t->sons.end(); ++it) {
+        Term *cmd = *it;
         if (cmd->kind == Function) {
-            root->decl_var(cmd->sons.front()->name);
-            root->set_var(cmd->sons.front()->name,
-                          std::make_shared<FuncValue>(root, cmd));
+            Term *name = cmd->sons.front();
+            root->decl_var(name->sym, is_boxed(name));
+            root->set_var(name->sym, make_closure(cmd, root));
         }
         else if (cmd->kind == Command) {
             if (cmd->subtype == Declaration) {
                 for (auto &var : cmd->sons) {
-                    root->decl_var(var->name);
+                    if (t->flat) root->renew_var(var->sym);
+                    else root->decl_var(var->sym, is_boxed(var));
                 }
             }
             else if (cmd->subtype == While) {
-                auto expr = eval_expr(cmd->sons.front(), root);
-                while (to_bool(expr)) {
-                    Scope *born = new Scope(root, root->count_vars());
+                Term *body = cmd->sons.back();
+                while (eval_bool(cmd->sons.front(), root)) {
+                    tick();
+                    if (body->flat) {
+                        auto res = execute_program(body, root);
+                        if (res) return res;
+                        continue;
+                    }
+                    Scope born(root, root->count_vars());
                     #if DEBUG_MODE
-                    cout << "While block scope: " << born->id <<endl;
+                    cout << "While block scope: " << born.id <<endl;
                     #endif
-                    auto res = execute_program(cmd->sons.back(), born);
+                    auto res = execute_program(body, &born);
                     // Early Return
                     if (res) {
-                        free_scope(res.get(), root);
                         return res;
                     }
-
-                    expr = eval_expr(cmd->sons.front(), root);
                 }
             }
             else if (cmd->subtype == If) {
                 auto it = cmd->sons.begin();
-                auto expr = eval_expr(*it, root);
-                Scope *born = new Scope(root, root->count_vars());
-                #if DEBUG_MODE
-                cout << "If block scope: " << born->id <<endl;
-                #endif
-                shared_ptr<Value> res;
-                if (to_bool(expr)) {
-                    res = execute_program(*++it, born);
+                bool cond = eval_bool(*it, root);
+                Term *branch = *std::next(it, cond ? 1 : 2);
+                Ref<Value> res;
+                if (branch->flat) {
+                    res = execute_program(branch, root);
                 } else {
-                    std::advance(it, 2);
-                    res = execute_program(*it, born);
+                    Scope born(root, root->count_vars());
+                    #if DEBUG_MODE
+                    cout << "If block scope: " << born.id <<endl;
+                    #endif
+                    res = execute_program(branch, &born);
                 }
                 // Early Return
                 if (res) {
-                    free_scope(res.get(), root);
                     return res;
                 }
             }
             else if (cmd->subtype == Return) {
                 auto expr = eval_expr(cmd->sons.front(), root);
-                switch (expr->kind) {
-                    case Func: {
-                        auto fv = std::static_pointer_cast<FuncValue>(expr);
-                        fv->ref = 0;
-                    }
-                    // fallthrough
-                    case Boolean:
-                    case Integer:
-                        free_scope(expr.get(), root);
-                        return expr;
-                    // unreachable
-                    default:
-                        root->unlink();
-                        cerr << "ERROR: Return unexpected value" << endl;
-                        return nullptr;
+                // An unassigned variable has nothing to return
+                if (!expr || expr->kind == Null) {
+                    throw RuntimeError("Return unexpected value");
                 }
+                return expr;
             }
             else if (cmd->subtype == Assign) {
                 auto it = cmd->sons.begin();
-                const string& name = (*it)->name;
+                u32 name = (*it)->sym;
                 root->set_var(name, eval_expr(*++it, root));
             }
             else if (cmd->subtype == Call) {
-                auto var = root->get_val(cmd->sons.front()->name);
-                const FuncValue *fv = static_cast<const FuncValue*>(var.get());
-                Scope *s = new Scope(fv->outer, fv->visible);
-                s->mark_top();
-                #if DEBUG_MODE
-                cout << "Call <" << cmd->sons.front()->name << "> scope: " << s->id <<endl;
-                #endif
-                init_params(fv, cmd, s, root);
+                auto var = root->get_val(cmd->sons.front()->sym);
+                auto fv = callee(var, cmd);
+                CallDepth guard(*this);
+                Scope s(fv->outer.get(), fv->visible);
+                enter_call(var, cmd, &s, root);
                 Term *func = fv->value();
-                execute_program(func->sons.back(), s);
+                if (func->observed) {
+                    observe_call(func, &s, [&] { return execute_program(func->sons.back(), &s); });
+                } else {
+                    execute_program(func->sons.back(), &s);
+                }
             }
             else if (cmd->subtype == Read) {
-                root->set_var(cmd->sons.front()->name, make_int(read_int()));
+                if (snapshot_pending) take_snapshot(cmd, root);
+                root->set_var(cmd->sons.front()->sym, make_int(read_int()));
             }
             else if (cmd->subtype == Print) {
-                auto res = eval_expr(cmd->sons.front(), root);
-                if (res->kind == Integer) {
+                Term *e = cmd->sons.front();
+                // A variable typed Int may still be unassigned, which prints nothing
+                if (e->type == IntType && e->subtype != VarName) {
+                    print_int(eval_int(e, root));
+                    continue;
+                }
+                auto res = eval_expr(e, root);
+                if (res && res->kind == Integer) {
                     print_int(to_int(res));
                 }
             }
         }
     }
-    free_scope(nullptr, root);
     if (t->father && t->father->kind == Function) {
         return make_int(0);
     }
@@ -275,47 +322,141 @@ shared_ptr<Value> Zitp::execute_program(Term *t, Scope *root) {
 }
 
 i32 Zitp::read_int() {
-    if (!_input.is_open()) {
+    if (!in) {
         _input = ifstream(input_file);
         if (!_input) {
-            cerr << "ERROR: Failed to open " << input_file << endl;
-            std::exit(1);
+            throw RuntimeError("Failed to open " + input_file);
         }
+        in = &_input;
     }
     i32 n = 0;
-    _input >> n;
+    *in >> n;
     return n;
 }
 
 void Zitp::print_int(i32 val) {
-    static bool first = true;
-    if (!_output.is_open()) {
+    if (!out) {
         _output = ofstream(output_file);
         if (!_output) {
-            cerr << "ERROR: Failed to open " << output_file << endl;
-            std::exit(1);
+            throw RuntimeError("Failed to open " + output_file);
         }
+        out = &_output;
     }
+    if (snapshot_pending) printed_values.push_back(val);
     if (!first) {
-        _output << ' ' << val;
+        *out << ' ' << val;
     } else {
-        _output << val;
+        *out << val;
         first = false;
     }
 }
 
 
+void Zitp::prepare(Term *ast) {
+    convert_closures(ast);
+    infer_types(ast);
+}
+
+void Zitp::load_body(Term *func) {
+    Term *block = func->sons.back();
+    if (!parse_body(block)) {
+        throw RuntimeError("Failed to parse the body of " + func->sons.front()->name());
+    }
+    try {
+        convert_body(func);
+        infer_body(func);
+    } catch (...) {
+        for (auto son : block->sons) delete son;
+        block->sons.clear();
+        throw;
+    }
+    block->lazy.reset();
+}
+
 void Zitp::run() {
     if (ast == nullptr) {
-        cerr << "ERROR: No AST" << endl;
-        std::exit(1);
+        throw RuntimeError("No AST");
     }
-    Scope *top = new Scope(nullptr, 0);
-    top->mark_top();
+    start_budget();
+    HeapLimit limit(budget.memory);
+    Scope top(nullptr, 0);
     #if DEBUG_MODE
-    cout << "Global scope: " << top->id << endl;
+    cout << "Global scope: " << top.id << endl;
     #endif
-    auto res = execute_program(ast, top);
-    _output << endl;
-    return;
+    if (!profile_file.empty()) apply_profile();
+    if (!record_file.empty()) start_profile();
+    if (threads && !budget.fuel && !budget.depth) start_parallel();
+    // Pops the functions a snapshot restored onto the frame stack
+    FrameMark mark(frames, &top);
+    usize from = restore_file.empty() ? 0 : restore_snapshot(&top);
+    if (engine == ClosureEngine) {
+        Compiled compiled(*this, ast);
+        for (auto fv : restored) fv->code = compiled.code_of(fv->value());
+        restored.clear();
+        compiled.run(&top, from);
+    } else {
+        restored.clear();
+        execute_program(ast, &top, from);
+    }
+    if (out) *out << endl;
+    if (profiler) save_profile();
+}
+
+void Zitp::start_budget() {
+    // Runs budget.fuel ticks, the next one stops the run
+    fuel = budget.fuel ? budget.fuel + 1 : 0;
+    depth = 0;
+    max_depth = budget.depth ? budget.depth : UINT32_MAX;
+}
+
+void Zitp::ticked() {
+    if (census_requested) heap_census("signal");
+    if (!fuel && budget.fuel) {
+        throw LimitError(FuelLimit, "Out of fuel");
+    }
+}
+
+void Zitp::start_parallel() {
+    parallel.reset(new Parallel(ast, threads));
+    std::vector<Term*> funcs{ast};
+    while (!funcs.empty()) {
+        Term *t = funcs.back();
+        funcs.pop_back();
+        if (parallel->find(t)) t->observed = true;
+        funcs.insert(funcs.end(), t->sons.begin(), t->sons.end());
+    }
+}
+
+u64 Zitp::program_hash() const {
+    std::ifstream ifs(prog_file);
+    std::ostringstream text;
+    text << ifs.rdbuf();
+    return ::program_hash(text.str());
+}
+
+void Zitp::run_stream() {
+    ProgramStream stream(prog_file);
+    if (!stream.good()) {
+        throw RuntimeError(prog_file + " cannot be found");
+    }
+    // Items reach here already detached, the batch block only runs them
+    Term batch(Block);
+    start_budget();
+    HeapLimit limit(budget.memory);
+    Scope top(nullptr, 0);
+    std::unique_ptr<Compiled> compiled;
+    if (engine == ClosureEngine) {
+        compiled.reset(new Compiled(*this, &batch));
+    }
+    while (stream.take(batch.sons)) {
+        bool returned = compiled ? compiled->run(&batch, &top)
+                                 : bool(execute_program(&batch, &top));
+        if (compiled) {
+            stream.release(batch.sons, [&](Term *item) { compiled->forget(item); });
+        } else {
+            stream.release(batch.sons);
+        }
+        if (returned) break;
+    }
+    if (out) *out << endl;
 }
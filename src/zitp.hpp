@@ -6,9 +6,23 @@
 #include <unordered_map>
 #include <string>
 #include <memory>
+#include <deque>
+#include <sstream>
 
 #include "Term.hpp"
 #include "value.hpp"
+#include "closure.hpp"
+#include "types.hpp"
+#include "compile.hpp"
+#include "profile.hpp"
+#include "parallel.hpp"
+#include "census.hpp"
+
+enum Engine {
+    TreeEngine,     // Walks the Term tree
+    QuickEngine,    // Walks the tree, quickening hot integer nodes
+    ClosureEngine,  // Runs the tree compiled to callables, see compile.hpp
+};
 
 class Zitp {
 private:
@@ -17,41 +31,236 @@ private:
     std::string prog_file = "program.txt";
     std::ifstream _input;
     std::ofstream _output;
+    std::istream *in;
+    std::ostream *out;
+    bool first = true;
+    Engine engine = QuickEngine;
+    bool lazy = false;
+    unsigned parse_threads = 0;
+    FusionStats fusion;
+    // Values are never shared between interpreters, counts are not atomic
+    Ref<Value> bools[2];
+    // Functions that cannot escape their block, see convert_closures()
+    std::deque<FuncValue> frames;
+
+    // State at the first Read, see snapshot.cpp
+    std::string snapshot_file, restore_file;
+    bool snapshot_pending = false;
+    std::vector<i32> printed_values;    // Output before it, replayed on restore
+    std::vector<FuncValue*> restored;   // Functions a restore made, given code by Compiled
+
+    // Profile recorded by or applied to this run, see profile.hpp
+    std::string record_file, profile_file;
+    std::unique_ptr<Profiler> profiler;
+    std::unordered_map<Term*, Memo> memos;
+
+    // Pure integer functions run by the parallel evaluator, see parallel.hpp
+    unsigned threads = 0;
+    std::unique_ptr<Parallel> parallel;
+
+    // Heap censuses of this run, see census.hpp
+    std::ofstream census_out;
+    unsigned censuses = 0;
+
+    Budget budget;
+    u64 fuel = 0;       // Left, counted down past 0 when there is no limit
+    u32 depth = 0, max_depth = 0;
+
+    // At every call and loop iteration: spends fuel and takes a census
+    // SIGUSR1 asked for
+    void tick() {
+        if (!--fuel || census_requested) ticked();
+    }
+    void ticked();
+    void start_budget();
 
+    // Counts a call against the depth limit while it runs
+    struct CallDepth {
+        Zitp& z;
+        explicit CallDepth(Zitp& zitp): z(zitp) {
+            if (++z.depth > z.max_depth) {
+                --z.depth;
+                throw LimitError(DepthLimit, "Call depth limit exceeded");
+            }
+        }
+        ~CallDepth() { --z.depth; }
+    };
+
+    // Pops the functions a block pushed on the frame stack, however it exits.
+    // The scope of the block still names them, so it lets go of them first.
+    struct FrameMark {
+        std::deque<FuncValue>& frames;
+        Scope *root;
+        usize size;
+        FrameMark(std::deque<FuncValue>& f, Scope *s): frames(f), root(s), size(f.size()) {}
+        ~FrameMark() {
+            if (frames.size() == size) return;
+            root->map.clear();
+            while (frames.size() > size) frames.pop_back();
+        }
+    };
+
+    void init_bools() {
+        bools[0] = make_ref<BoolValue>(false);
+        bools[1] = make_ref<BoolValue>(true);
+    }
     i32 read_int();
     void print_int(i32 val);
 
     void init_params(const FuncValue *fv, Term *argus, Scope *born, Scope *current);
-    std::shared_ptr<Value> eval_expr(Term *t, Scope *current);
-    std::shared_ptr<Value> execute_program(Term *t, Scope *root);
+    void enter_call(const Ref<Value>& var, Term *call, Scope *s, Scope *current);
+    Ref<Value> make_closure(Term *func, Scope *root);
+    static i32 checked_int(const Ref<Value>& v, Term *t);
+    // Typed paths for expressions known to be Int or Bool, see infer_types()
+    i32 eval_int(Term *t, Scope *current);
+    bool eval_bool(Term *t, Scope *current);
+    Ref<Value> eval_expr(Term *t, Scope *current);
+    Ref<Value> execute_program(Term *t, Scope *root, usize from = 0);
+    void take_snapshot(Term *read, Scope *root);
+    // Rebuilds the global scope, returns the top-level command to resume at
+    usize restore_snapshot(Scope *top);
+    u64 program_hash() const;
+    void start_profile();
+    void save_profile();
+    void apply_profile();
+    void start_parallel();
+
+    // Runs a call of an observed function whose arguments are bound in s,
+    // body runs it when its memo table has no result yet and the parallel
+    // evaluator does not take it
+    template <class Body>
+    Ref<Value> observe_call(Term *func, Scope *s, Body body) {
+        CallArgs args(func, s);
+        Memo *memo = nullptr;
+        const Parallel::Pure *pure = nullptr;
+        if (args.all_ints()) {
+            auto it = memos.find(func);
+            if (it != memos.end()) memo = &it->second;
+            if (parallel) pure = parallel->find(func);
+        }
+        i32 known;
+        Ref<Value> res;
+        if (memo && memo->find(args.ints, known)) {
+            res = make_ref<IntValue>(known);
+        } else {
+            if (pure) {
+                res = make_ref<IntValue>(parallel->call(pure, args.ints));
+            } else {
+                res = body();
+            }
+            if (memo && res && res->kind == Integer) {
+                memo->store(args.ints, static_cast<const IntValue*>(res.get())->value());
+            }
+        }
+        if (profiler) profiler->record(func, args, s->map.capacity(), res);
+        return res;
+    }
 
 public:
     Term *ast;
 
-    Zitp(const char *prog, const char *in, const char *out):
-        ast(nullptr)
+    Zitp(const char *prog, const char *infile, const char *outfile):
+        in(nullptr), out(nullptr), ast(nullptr)
     {
+        init_bools();
         if (prog) {
             prog_file = std::string(prog);
         }
-        if (in) {
-            input_file = std::string(in);
+        if (infile) {
+            input_file = std::string(infile);
         }
-        if (out) {
-            output_file = std::string(out);
+        if (outfile) {
+            output_file = std::string(outfile);
         }
     }
 
+    // Run an already parsed program against in-memory streams,
+    // used by the server to skip reparsing cached programs.
+    Zitp(Term *t, std::istream &is, std::ostream &os):
+        in(&is), out(&os), ast(t)
+    {
+        init_bools();
+    }
+
     bool parse_ast() {
         std::ifstream ifs(prog_file);
         if (!ifs) {
             std::cerr << prog_file << " cannot be found" << std::endl;
             return false;
         }
-        ast = parse(ifs);
+        if (lazy || parse_threads > 1) {
+            std::ostringstream text;
+            text << ifs.rdbuf();
+            auto shared = std::make_shared<const std::string>(text.str());
+            ast = lazy ? parse_lazy(shared) : parse_parallel(shared, parse_threads);
+        } else {
+            ast = parse(ifs);
+        }
+        if (ast) prepare(ast);
         return ast != nullptr;
     }
 
+    // Static passes the evaluator relies on, run once per parsed program.
+    // Throws RuntimeError for programs that are ill-typed.
+    static void prepare(Term *ast);
+    // Parses and prepares a body parse_lazy() skipped, on its first call
+    static void load_body(Term *func);
+
+    // Skip Function bodies until they are called, see parse_lazy().
+    // Loading writes into the tree, the server always parses eagerly.
+    void set_lazy(bool l) { lazy = l; }
+
+    // Parses Function bodies on n threads, see parse_parallel()
+    void set_parse_threads(unsigned n) { parse_threads = n; }
+
+    // Saves the global scope at the first Read to path, when it is a
+    // top-level command, or continues from such a snapshot instead of
+    // running the program from its start
+    void snapshot_after_init(const std::string& path) {
+        snapshot_file = path;
+        snapshot_pending = true;
+    }
+    void restore_from(const std::string& path) { restore_file = path; }
+
+    // Records a profile of this run to path, or applies one an earlier run
+    // of the same program recorded before running, see profile.hpp
+    void record_profile(const std::string& path) { record_file = path; }
+    void use_profile(const std::string& path) { profile_file = path; }
+
+    // Runs calls of pure integer functions on n threads, see parallel.hpp
+    void set_parallel(unsigned n) { threads = n; }
+
+    // Limits every later run, see Budget
+    void set_budget(const Budget& b) { budget = b; }
+
+    // Native stack a run needs to nest depth calls. A call of the tree
+    // walker takes about 1.5 KB in a debug build, call_stack leaves room for
+    // the expressions it nests and for slower engines.
+    static const usize call_stack = 6 << 10;
+    static constexpr usize stack_for(u32 depth) { return usize(depth) * call_stack + (1 << 20); }
+
+    // Writes a heap census to path at exit and on SIGUSR1, see census.hpp
+    bool heap_census_to(const std::string& path) {
+        census_out.open(path, std::ios::trunc);
+        return census_out.is_open();
+    }
+    // Writes one now, when a file was given
+    void heap_census(const char *reason);
+
+    // Quickening writes into the tree, so trees shared between threads
+    // must use another engine
+    void set_engine(Engine e) { engine = e; }
+
     void run();
+    // Runs the top-level items of the program while it is being parsed,
+    // instead of parse_ast() and run(), see stream.hpp
+    void run_stream();
+
+    // Counters of the closure compiled engine
+    const FusionStats& fusion_stats() const { return fusion; }
+
+    friend struct QuickHandlers;
+    friend class Compiled;
+    friend struct CompiledHandlers;
 };
 #endif
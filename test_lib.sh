@@ -0,0 +1,32 @@
+# Sourced by the run_*_test.sh scripts. Takes the binary from the script's
+# first argument and sets up a scratch directory removed on exit, scripts
+# end with `exit $status`.
+
+HERE=$(realpath "$0")
+HERE=$(dirname "$HERE")
+prog="${1:-$HERE/build/zitp}"
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+status=0
+
+# Sets name and in for the test case in directory $1, in is /dev/null for
+# cases that read nothing
+use_case() {
+    name=$(basename "$1")
+    in="$1/input.txt"
+    [[ -f "$in" ]] || in=/dev/null
+}
+
+# Whether the case in directory $1, run with the remaining options, exits
+# with 0 and prints its expected output
+prints_expected() {
+    local p=$1
+    shift
+    "$prog" "$@" -p "$p/program.txt" -i "$in" -o "$dir/out" >/dev/null &&
+        diff -q "$p/output.expected" "$dir/out" >/dev/null
+}
+
+fail() {
+    echo >&2 "Failed: $*"
+    status=1
+}